@@ -0,0 +1,160 @@
+"""Benchmarks for the shell in this directory.
+
+Build the shell first, then pick a benchmark:
+
+    gcc -O3 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 -o shell shell.c myshell.c tokenizer.c
+    python3 bench.py suite --json results.json
+    python3 bench.py cat --size-mb 4096
+    python3 bench.py pipeline --stages 4 --size-mb 4096
+
+Every benchmark drives ./shell (or $SHELL_BIN) through its stdin, exactly like a
+user would. Results are printed as a table; --json also writes them as a list of
+{"name", "value", "unit"} records so runs can be compared for regressions in
+process_arglist. Extra shell flags (for example -Z) go in --shell-args.
+"""
+import argparse
+import json
+import os
+import shlex
+import subprocess
+import time
+from tempfile import TemporaryDirectory
+from typing import Callable, Dict, List
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SHELL = os.environ.get("SHELL_BIN", os.path.join(HERE, "shell"))
+CHUNK = 1 << 20
+
+Result = Dict[str, object]
+shell_args: List[str] = []
+
+
+def run_shell(script: str) -> float:
+    """Feed script to a fresh shell and return the wall time it took."""
+    start = time.perf_counter()
+    subprocess.run(
+        [SHELL] + shell_args,
+        input=script.encode(),
+        stdout=subprocess.DEVNULL,
+        check=True,
+    )
+    return time.perf_counter() - start
+
+
+def best_of(runs: int, script: str) -> float:
+    run_shell(script)  # warm the page cache
+    return min(run_shell(script) for _ in range(runs))
+
+
+def make_file(path: str, size_mb: int) -> None:
+    block = os.urandom(CHUNK)
+    with open(path, "wb") as f:
+        for _ in range(size_mb):
+            f.write(block)
+
+
+def result(name: str, value: float, unit: str) -> Result:
+    return {"name": name, "value": round(value, 3), "unit": unit}
+
+
+def pipeline(src: str, stages: int) -> str:
+    """cat src | /bin/cat ... | wc -c, with stages commands in total."""
+    return " | ".join(["cat %s" % src] + ["/bin/cat"] * (stages - 2) + ["wc -c"])
+
+
+def bench_cat(args: argparse.Namespace) -> List[Result]:
+    """Builtin cat (splice/copy_file_range/sendfile) against /bin/cat."""
+    results = []
+    with TemporaryDirectory(dir=args.dir) as d:
+        src = os.path.join(d, "src")
+        dst = os.path.join(d, "dst")
+        make_file(src, args.size_mb)
+        cases = {
+            "redirect": "{cat} %s > %s\n" % (src, dst),
+            "pipe": "{cat} %s | wc -c\n" % src,
+        }
+        for name, line in cases.items():
+            for label, cat in (("builtin", "cat"), ("bin", "/bin/cat")):
+                t = best_of(args.runs, line.format(cat=cat))
+                results.append(result(f"cat_{name}_{label}", args.size_mb / t, "MB/s"))
+    return results
+
+
+def bench_pipeline(args: argparse.Namespace) -> List[Result]:
+    """N-stage pipeline throughput with and without pipesize and @cpu pinning."""
+    ncpu = os.cpu_count() or 1
+    results = []
+    with TemporaryDirectory(dir=args.dir) as d:
+        src = os.path.join(d, "src")
+        make_file(src, args.size_mb)
+        for pinned in (False, True):
+            for size in ("0", "1m"):
+                stages = pipeline(src, args.stages).split(" | ")
+                if pinned:
+                    # neighbouring stages on neighbouring CPUs
+                    stages = ["@%d %s" % (i % ncpu, st) for i, st in enumerate(stages)]
+                script = "pipesize %s\n%s\n" % (size, " | ".join(stages))
+                t = best_of(args.runs, script)
+                name = "pipeline_%d_pipesize_%s_%s" % (
+                    args.stages,
+                    size,
+                    "pinned" if pinned else "floating",
+                )
+                results.append(result(name, args.size_mb / t, "MB/s"))
+    return results
+
+
+def bench_suite(args: argparse.Namespace) -> List[Result]:
+    """Launch rate, pipe and redirection throughput, background job launch."""
+    results = []
+    empty = best_of(args.runs, "")
+
+    t = best_of(args.runs, "true\n" * args.commands) - empty
+    results.append(result("trivial_commands", args.commands / t, "cmd/s"))
+
+    t = best_of(args.runs, "true &\n" * args.jobs) - empty
+    results.append(result("background_%d_jobs" % args.jobs, t * 1e3, "ms"))
+
+    with TemporaryDirectory(dir=args.dir) as d:
+        src = os.path.join(d, "src")
+        dst = os.path.join(d, "dst")
+        make_file(src, args.size_mb)
+        for stages in (2, args.stages):
+            t = best_of(args.runs, pipeline(src, stages) + "\n")
+            results.append(result("pipe_%d_stages" % stages, args.size_mb / t, "MB/s"))
+        t = best_of(args.runs, "/bin/cat %s > %s\n" % (src, dst))
+        results.append(result("redirect", args.size_mb / t, "MB/s"))
+    return results
+
+
+BENCHMARKS: Dict[str, Callable[[argparse.Namespace], List[Result]]] = {
+    "cat": bench_cat,
+    "pipeline": bench_pipeline,
+    "suite": bench_suite,
+}
+
+
+def main(argv: List[str] = None) -> None:
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("benchmark", choices=sorted(BENCHMARKS))
+    parser.add_argument("--size-mb", type=int, default=1024)
+    parser.add_argument("--runs", type=int, default=3)
+    parser.add_argument("--stages", type=int, default=4)
+    parser.add_argument("--commands", type=int, default=2000)
+    parser.add_argument("--jobs", type=int, default=1000)
+    parser.add_argument("--dir", default=None, help="where to put scratch files")
+    parser.add_argument("--shell-args", default="", help="extra flags for the shell")
+    parser.add_argument("--json", default=None, help="also write results here")
+    args = parser.parse_args(argv)
+
+    shell_args.extend(shlex.split(args.shell_args))
+    results = BENCHMARKS[args.benchmark](args)
+    for r in results:
+        print(f"{r['name']:<40} {r['value']:>12} {r['unit']}")
+    if args.json is not None:
+        with open(args.json, "w") as f:
+            json.dump({"shell": SHELL, "args": shell_args, "results": results}, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
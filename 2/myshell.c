@@ -9,17 +9,34 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
 #include <err.h>
 #include <math.h>
+#include "tokenizer.h"
 
-/* gcc -O3 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 -o shell shell.c myshell.c */
+/* gcc -O3 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 -o shell shell.c myshell.c tokenizer.c */
+
+int process_arglist(int count, char **arglist);
+static void zygote_start(void);
+static int zygote_wait(pid_t pid, struct rusage *ru);
 
 /* zombie processes prevention : https://www.geeksforgeeks.org/zombie-processes-prevention/ */
 
+/* set by SIGINT, lets builtins running inside the shell process stop early */
+static volatile sig_atomic_t interrupted;
+
 /* signal handler */
-void handler(int signum, siginfo_t *info, void *ptr) {}
+void handler(int signum, siginfo_t *info, void *ptr) {
+	interrupted = 1;
+}
 
 
 /* Background child processes should not terminate upon SIGINT */
@@ -49,97 +66,859 @@ int prepare(void){
   		fprintf(stderr, "%s\n", strerror(errno));
     	exit(1);
     }
+    zygote_start(); /* while the heap is still small */
     return 0;
     
 }
+/* wall clock in seconds, for reporting elapsed time of builtins */
+static double now_sec(void){
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* resource usage of the foreground children reaped by wait_fg() since the last reset */
+static struct rusage fg_usage;
+
+static double tv_sec(struct timeval tv){
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void add_usage(struct rusage *to, const struct rusage *ru){
+
+	timeradd(&to->ru_utime, &ru->ru_utime, &to->ru_utime);
+	timeradd(&to->ru_stime, &ru->ru_stime, &to->ru_stime);
+	if (ru->ru_maxrss > to->ru_maxrss)
+		to->ru_maxrss = ru->ru_maxrss;
+}
+
+/* foreground children have to stay waitable (no SIGCHLD SIG_IGN) until wait_fg() collected them */
+static void fg_begin(void){
+	signal(SIGCHLD, SIG_DFL);
+}
+
+/* wait for a foreground child and account its resource usage in fg_usage */
+static void wait_fg(pid_t pid){
+
+	struct rusage ru;
+	
+	if (pid <= 0) /* rejected by launch() */
+		return;
+	if (zygote_wait(pid, &ru)) {
+		add_usage(&fg_usage, &ru);
+		return;
+	}
+	while (wait4(pid, NULL, WUNTRACED, &ru) == -1) {
+		if (errno == ECHILD)
+			return;
+		if (errno != EINTR) {
+			fprintf(stderr, "%s\n", strerror(errno));
+			exit(1);
+		}
+	}
+	add_usage(&fg_usage, &ru);
+}
+
+/* back to zombie prevention, reaping background children that exited while SIGCHLD was not ignored */
+static void fg_end(void){
+
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		;
+	signal(SIGCHLD, SIG_IGN);
+}
+
 /* 
-* arglist - a list of char* arguments (words) provided by the user
-* it contains count+1 items, where the last item (arglist[count]) and *only* the last is NULL
-* RETURNS - 1 if should continue, 0 otherwise 
+* copy everything left in in_fd to out_fd through a user space buffer
+* RETURNS - 0 on success, -1 with errno set otherwise (EINTR if SIGINT cut the copy short)
 */
-int process_arglist(int count, char **arglist){
+static int copy_fd(int in_fd, int out_fd){
+
+	char buf[65536];
+	ssize_t n;
+	
+	while (!interrupted && (n = read(in_fd, buf, sizeof(buf))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (ssize_t off = 0; off < n; ) {
+			ssize_t w = write(out_fd, buf + off, n - off);
+			if (w == -1) {
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			off += w;
+		}
+	}
+	if (interrupted) {
+		errno = EINTR;
+		return -1;
+	}
+	return 0;
+}
+
+/* bytes moved per kernel call, small enough that SIGINT is noticed quickly */
+#define MOVE_CHUNK (16 << 20)
+
+/* 
+* move everything left in in_fd to out_fd without copying it through user space where the kernel allows:
+* splice() into a pipe, copy_file_range() between regular files, sendfile() from a regular file to anything
+* else, and read()/write() when none of these apply. Each zero-copy call falls back on the first call only,
+* since an error after data was moved is a real error.
+* RETURNS - 0 on success, -1 with errno set otherwise (EINTR if SIGINT cut the move short)
+*/
+static int move_fd(int in_fd, int out_fd){
+
+	struct stat in_st, out_st;
+	ssize_t n;
+	int moved;
 	
-	int pipe_ind = 0;
+	if (fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1)
+		return -1;
+		
+	if (S_ISFIFO(out_st.st_mode)) {
+		for (moved = 0; !interrupted; moved = 1) {
+			n = splice(in_fd, NULL, out_fd, NULL, MOVE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (n == 0)
+				return 0;
+			if (n == -1 && errno != EINTR) {
+				if (moved || errno != EINVAL)
+					return -1;
+				break;
+			}
+		}
+	}
+	else if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+		for (moved = 0; !interrupted; moved = 1) {
+			n = copy_file_range(in_fd, NULL, out_fd, NULL, MOVE_CHUNK, 0);
+			if (n == 0)
+				return 0;
+			if (n == -1 && errno != EINTR) {
+				/* EBADF: out_fd was opened with O_APPEND */
+				if (moved || (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF))
+					return -1;
+				break;
+			}
+		}
+	}
+	if (S_ISREG(in_st.st_mode)) {
+		for (moved = 0; !interrupted; moved = 1) {
+			n = sendfile(out_fd, in_fd, NULL, MOVE_CHUNK);
+			if (n == 0)
+				return 0;
+			if (n == -1 && errno != EINTR) {
+				if (moved || (errno != EINVAL && errno != ENOSYS))
+					return -1;
+				break;
+			}
+		}
+	}
+	return copy_fd(in_fd, out_fd);
+}
+
+/* 
+* the builtin cat only takes plain operands ("-" is stdin); with any option the real cat runs instead
+*/
+static int is_builtin_cat(char **arglist){
+
+	if (arglist[0] == NULL || strcmp(arglist[0], "cat"))
+		return 0;
+	for (int i = 1; arglist[i] != NULL; i++)
+		if (arglist[i][0] == '-' && arglist[i][1] != '\0')
+			return 0;
+	return 1;
+}
+
+/* 
+* Builtin cat: concatenates the files in arglist (a NULL terminated cat command line) into out_fd using move_fd().
+* Runs inside the shell for plain commands and redirections, and inside the forked child for pipeline stages.
+* RETURNS - 0 if every operand was copied, 1 otherwise (the exit status cat would have)
+*/
+static int cat_files(char **arglist, int out_fd){
+
+	static char *stdin_only[] = {"cat", "-", NULL};
+	int status = 0;
 	
-	/* pipe symbol '|' search */
+	if (arglist[1] == NULL)
+		arglist = stdin_only;
+	interrupted = 0;
+	fflush(stdout);
+	for (int i = 1; arglist[i] != NULL && !interrupted; i++) {
+		int in_fd = strcmp(arglist[i], "-") ? open(arglist[i], O_RDONLY) : 0;
+		if (in_fd == -1 || move_fd(in_fd, out_fd) == -1) {
+			fprintf(stderr, "cat: %s: %s\n", arglist[i], strerror(errno));
+			status = 1;
+		}
+		if (in_fd > 0)
+			close(in_fd);
+	}
+	return status;
+}
+
+/* 
+* runs in a freshly forked child: wire up stdin/stdout (-1 keeps the inherited one), drop every other
+* descriptor (the other pipe ends included), pin it to cpus (NULL inherits the shell's affinity) and run the
+* command or the builtin cat. Never returns.
+*/
+static void exec_child(char **argv, int in_fd, int out_fd, int background, const cpu_set_t *cpus){
+
+	if (cpus != NULL && sched_setaffinity(0, sizeof(cpu_set_t), cpus) == -1)
+		fprintf(stderr, "%s: sched_setaffinity: %s\n", argv[0], strerror(errno));
+	if (background)
+		background_sig_pro();	/* Background child processes should not terminate upon SIGINT */
+	else
+		signal(SIGINT, SIG_DFL);
+	if ((in_fd != -1 && dup2(in_fd, 0) == -1) || (out_fd != -1 && dup2(out_fd, 1) == -1)) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		_exit(1);
+	}
+	close_range(3, ~0U, 0);
+	if (is_builtin_cat(argv))
+		_exit(cat_files(argv, 1));
+	if (execvp(argv[0], argv) == -1) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+		_exit(1);
+	}
+	_exit(1);
+}
+
+/* Zygote launcher
+* With -Z, prepare() forks a helper while the shell's heap is still small. Commands are sent to it over a
+* SOCK_SEQPACKET socketpair, their stdin/stdout travel along as SCM_RIGHTS, and the helper forks them from
+* its own small image, so launch latency no longer grows with the shell's RSS. The helper answers with the
+* child's pid, and later with its exit status and rusage. Background children are reaped by the helper and
+* never reported, so unread replies can't pile up while the shell is busy.
+*/
+#define ZY_MSG_MAX 65536
+
+struct zy_req {
+	int background;
+	int has_in, has_out; /* which of stdin/stdout come with the message, in that order */
+	int has_cpus;
+	cpu_set_t cpus;
+	int argc;
+	/* followed by argc '\0' terminated strings */
+};
+
+struct zy_reply {
+	pid_t pid;
+	int err;	/* fork failure (pid is -1) */
+	int exited;	/* 0: pid was started, 1: pid exited */
+	int status;
+	struct rusage ru;
+};
+
+/* foreground children started by the zygote and not yet waited for */
+struct zy_child {
+	pid_t pid;
+	int exited;
+	struct rusage ru;
+};
+
+static int use_zygote;
+static int zygote_fd = -1;
+static struct zy_child *zy_children;
+static int zy_nchildren, zy_cap;
+
+void enable_zygote(void){
+	use_zygote = 1;
+}
+
+static void zy_send(int sock, struct zy_reply *r){
+	while (send(sock, r, sizeof(*r), MSG_NOSIGNAL) == -1 && errno == EINTR)
+		;
+}
+
+/* helper side: fork one command from a request message */
+static void zygote_launch_one(int sock, char *msg, ssize_t len, int *fds, int nfds, pid_t **fg, int *nfg, int *fg_cap, sigset_t *mask){
+
+	struct zy_req *req = (struct zy_req*) msg;
+	char *argv[len / 2 + 1]; /* each string takes at least 2 bytes */
+	char *p = msg + sizeof(*req);
+	struct zy_reply r = {0};
+	
+	for (int i = 0; i < req->argc; i++) {
+		argv[i] = p;
+		p += strlen(p) + 1;
+	}
+	argv[req->argc] = NULL;
+	int in_fd = req->has_in && nfds > 0 ? fds[0] : -1;
+	int out_fd = req->has_out && nfds > req->has_in ? fds[req->has_in] : -1;
+	
+	r.pid = fork();
+	if (r.pid == 0) {
+		sigprocmask(SIG_SETMASK, mask, NULL);
+		signal(SIGCHLD, SIG_DFL);
+		exec_child(argv, in_fd, out_fd, req->background, req->has_cpus ? &req->cpus : NULL);
+	}
+	r.err = r.pid == -1 ? errno : 0;
+	for (int i = 0; i < nfds; i++)
+		close(fds[i]);
+	if (r.pid > 0 && !req->background) {
+		if (*nfg == *fg_cap) {
+			*fg_cap = *fg_cap ? 2 * *fg_cap : 16;
+			if ((*fg = realloc(*fg, sizeof(pid_t) * *fg_cap)) == NULL)
+				_exit(1);
+		}
+		(*fg)[(*nfg)++] = r.pid;
+	}
+	zy_send(sock, &r);
+}
+
+/* helper main loop: requests on the socket, exits through a signalfd; leaves when the shell is gone */
+static void zygote_main(int sock){
+
+	sigset_t chld, old;
+	pid_t *fg = NULL;
+	int nfg = 0, fg_cap = 0;
+	char msg[ZY_MSG_MAX];
+	char cbuf[CMSG_SPACE(2 * sizeof(int))];
+	
+	signal(SIGINT, SIG_IGN); /* the terminal's ^C is for the foreground commands, not for us */
+	signal(SIGCHLD, SIG_DFL);
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &old);
+	int sfd = signalfd(-1, &chld, SFD_CLOEXEC);
+	if (sfd == -1) {
+		fprintf(stderr, "zygote: %s\n", strerror(errno));
+		_exit(1);
+	}
+	struct pollfd pfds[2] = {{.fd = sock, .events = POLLIN}, {.fd = sfd, .events = POLLIN}};
+	
+	while (1) {
+		if (poll(pfds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			_exit(1);
+		}
+		if (pfds[1].revents & POLLIN) {
+			struct signalfd_siginfo si;
+			struct zy_reply r = {.exited = 1};
+			if (read(sfd, &si, sizeof(si)) == -1 && errno != EAGAIN)
+				_exit(1);
+			while ((r.pid = wait4(-1, &r.status, WNOHANG, &r.ru)) > 0) {
+				for (int i = 0; i < nfg; i++) {
+					if (fg[i] == r.pid) {
+						fg[i] = fg[--nfg];
+						zy_send(sock, &r);
+						break;
+					}
+				}
+			}
+		}
+		if (pfds[0].revents) {
+			struct iovec iov = {.iov_base = msg, .iov_len = sizeof(msg)};
+			struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf)};
+			int fds[2], nfds = 0;
+			ssize_t n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n <= 0) /* the shell exited */
+				_exit(0);
+			for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c != NULL; c = CMSG_NXTHDR(&mh, c)) {
+				if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+					nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+					memcpy(fds, CMSG_DATA(c), nfds * sizeof(int));
+				}
+			}
+			if (n >= (ssize_t) sizeof(struct zy_req))
+				zygote_launch_one(sock, msg, n, fds, nfds, &fg, &nfg, &fg_cap, &old);
+		}
+	}
+}
+
+static void zygote_start(void){
+
+	int sv[2];
+	
+	if (!use_zygote)
+		return;
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		exit(1);
+	}
+	pid_t pid = fork();
+	if (pid == -1) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		exit(1);
+	}
+	if (pid == 0) {
+		close(sv[0]);
+		zygote_main(sv[1]);
+	}
+	close(sv[1]);
+	zygote_fd = sv[0];
+}
+
+/* the helper is gone: forget it, launches go back to plain fork() */
+static void zygote_lost(void){
+
+	fprintf(stderr, "zygote exited, falling back to fork\n");
+	close(zygote_fd);
+	zygote_fd = -1;
+	for (int i = 0; i < zy_nchildren; i++)
+		zy_children[i].exited = 1;
+}
+
+/* read one reply; exit reports are parked in zy_children. RETURNS - 0 if the helper is gone */
+static int zygote_recv(struct zy_reply *r){
+
+	ssize_t n;
+	
+	while ((n = recv(zygote_fd, r, sizeof(*r), 0)) == -1 && errno == EINTR)
+		;
+	if (n != sizeof(*r)) {
+		zygote_lost();
+		return 0;
+	}
+	if (r->exited) {
+		for (int i = 0; i < zy_nchildren; i++) {
+			if (zy_children[i].pid == r->pid) {
+				zy_children[i].exited = 1;
+				zy_children[i].ru = r->ru;
+			}
+		}
+	}
+	return 1;
+}
+
+/* 
+* shell side: ask the helper to start argv.
+* RETURNS - the child's pid, or 0 if the zygote can't take it (not running, gone, or argv too large)
+*/
+static pid_t zygote_launch(char **argv, int in_fd, int out_fd, int background, const cpu_set_t *cpus){
+
+	static char msg[ZY_MSG_MAX];
+	struct zy_req *req = (struct zy_req*) msg;
+	char cbuf[CMSG_SPACE(2 * sizeof(int))] = {0};
+	size_t len = sizeof(*req);
+	int fds[2], nfds = 0;
+	struct zy_reply r;
+	
+	if (zygote_fd == -1)
+		return 0;
+	req->background = background;
+	req->has_in = in_fd != -1;
+	req->has_out = out_fd != -1;
+	req->has_cpus = cpus != NULL;
+	if (cpus != NULL)
+		req->cpus = *cpus;
+	for (req->argc = 0; argv[req->argc] != NULL; req->argc++) {
+		size_t l = strlen(argv[req->argc]) + 1;
+		if (len + l > sizeof(msg))
+			return 0;
+		memcpy(msg + len, argv[req->argc], l);
+		len += l;
+	}
+	if (in_fd != -1)
+		fds[nfds++] = in_fd;
+	if (out_fd != -1)
+		fds[nfds++] = out_fd;
+		
+	struct iovec iov = {.iov_base = msg, .iov_len = len};
+	struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1};
+	if (nfds > 0) {
+		mh.msg_control = cbuf;
+		mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+	}
+	ssize_t n;
+	while ((n = sendmsg(zygote_fd, &mh, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+		;
+	if (n == -1) {
+		zygote_lost();
+		return 0;
+	}
+	do {
+		if (!zygote_recv(&r))
+			return 0;
+	} while (r.exited);
+	if (r.pid == -1) {
+		fprintf(stderr, "%s\n", strerror(r.err));
+		exit(1);
+	}
+	if (!background) {
+		if (zy_nchildren == zy_cap) {
+			zy_cap = zy_cap ? 2 * zy_cap : 16;
+			zy_children = realloc(zy_children, sizeof(struct zy_child) * zy_cap);
+			if (zy_children == NULL) {
+				fprintf(stderr, "%s\n", strerror(errno));
+				exit(1);
+			}
+		}
+		zy_children[zy_nchildren++] = (struct zy_child){.pid = r.pid};
+	}
+	return r.pid;
+}
+
+/* RETURNS - 1 if pid was started by the zygote (ru is filled once it exited), 0 for a child of our own */
+static int zygote_wait(pid_t pid, struct rusage *ru){
+
+	struct zy_reply r;
+	
+	for (int i = 0; i < zy_nchildren; i++) {
+		if (zy_children[i].pid != pid)
+			continue;
+		while (!zy_children[i].exited && zygote_recv(&r))
+			;
+		*ru = zy_children[i].ru;
+		zy_children[i] = zy_children[--zy_nchildren];
+		return 1;
+	}
+	return 0;
+}
+
+/* 
+* "0,2-3" -> {0, 2, 3}
+* RETURNS - 0 on success, -1 on a malformed list
+*/
+static int parse_cpulist(const char *s, cpu_set_t *set){
+
+	char *end;
+	
+	CPU_ZERO(set);
+	if (*s == '\0')
+		return -1;
+	while (*s != '\0') {
+		long first = strtol(s, &end, 10), last;
+		if (end == s || first < 0)
+			return -1;
+		last = first;
+		if (*end == '-') {
+			s = end + 1;
+			last = strtol(s, &end, 10);
+			if (end == s || last < first)
+				return -1;
+		}
+		if (last >= CPU_SETSIZE)
+			return -1;
+		for (long c = first; c <= last; c++)
+			CPU_SET(c, set);
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		s = end;
+	}
+	return 0;
+}
+
+/* 
+* start argv with the given stdin/stdout (-1 keeps the shell's), through the zygote when there is one.
+* A leading "@cpulist" word pins the command to those CPUs (sched_setaffinity in the child).
+* RETURNS - the child's pid, or 0 if the command was rejected
+*/
+static pid_t launch(char **argv, int in_fd, int out_fd, int background){
+
+	cpu_set_t set, *cpus = NULL;
+	
+	if (argv[0] == NULL) {
+		fprintf(stderr, "syntax error: missing command\n");
+		return 0;
+	}
+	if (argv[0][0] == '@') {
+		if (parse_cpulist(argv[0] + 1, &set) == -1 || argv[1] == NULL) {
+			fprintf(stderr, "%s: bad cpu list or missing command\n", argv[0]);
+			return 0;
+		}
+		cpus = &set;
+		argv++;
+	}
+	pid_t pid = zygote_launch(argv, in_fd, out_fd, background, cpus);
+	
+	if (pid > 0)
+		return pid;
+	pid = fork();
+	if (pid == -1) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		exit(1);
+	}
+	if (pid == 0)
+		exec_child(argv, in_fd, out_fd, background, cpus);
+	return pid;
+}
+
+/* pipe buffer size for new pipelines (F_SETPIPE_SZ), 0 keeps the kernel default */
+static int pipe_size;
+
+/* 
+* pipesize [bytes[k|m]] - size the pipes of the following pipelines; 0 restores the default (64 KB).
+* Without an argument prints the current setting. Sizes above /proc/sys/fs/pipe-max-size need privileges.
+*/
+static int pipesize_builtin(int count, char **arglist){
+
+	char *end;
+	long size;
+	int shift = 0;
+	
+	if (count == 1) {
+		printf("%d\n", pipe_size);
+		fflush(stdout);
+		return 1;
+	}
+	errno = 0;
+	size = strtol(arglist[1], &end, 10);
+	if (*end == 'k' || *end == 'K')
+		shift = 10, end++;
+	else if (*end == 'm' || *end == 'M')
+		shift = 20, end++;
+	/* range checked before shifting, a large size must not wrap back into it */
+	if (count != 2 || errno == ERANGE || *end != '\0' || size < 0 || size > (1L << 30) >> shift) {
+		fprintf(stderr, "usage: pipesize [bytes[k|m]]\n");
+		return 1;
+	}
+	pipe_size = size << shift;
+	return 1;
+}
+
+/* one command line handed to parallel */
+struct job {
+	pid_t pid;		/* 0 once the child has been reaped */
+	FILE *out;		/* -k only: temporary file holding the job's stdout */
+	int status;
+};
+
+/* run a single job line in a new child, stdout optionally redirected to out */
+static pid_t job_start(char *line, FILE *out){
+
+	struct tok_arena arena = {0};
+	char **argv;
+	int argc;
+	
+	pid_t pid = fork();
+	if (pid == -1) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		exit(1);
+	}
+	if (pid != 0) /* parent */
+		return pid;
+		
+	/* child: the zygote socket belongs to the shell, nested commands fork directly */
+	zygote_fd = -1;
+	zy_nchildren = 0;
+	if (out != NULL && dup2(fileno(out), 1) == -1) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		_exit(1);
+	}
+	if ((argc = tokenize(&arena, line, strlen(line), &argv)) <= 0) {
+		if (argc == -1)
+			fprintf(stderr, "parallel: unterminated quote: %s", line);
+		_exit(argc == -1);
+	}
+	
+	/* 
+	* lines using pipes, redirection or '&' go through the regular shell path.
+	* _exit() rather than exit(): exit() would seek the shared input file back to the stdio read position.
+	*/
+	for (int i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "|") || !strcmp(argv[i], ">") || !strcmp(argv[i], "&")) {
+			process_arglist(argc, argv);
+			_exit(0);
+		}
+	}
+	if (execvp(argv[0], argv) == -1) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+		_exit(1);
+	}
+	return 0;
+}
+
+/* Parallel job-slot executor (builtin)
+* parallel [-k] N [file]
+* reads command lines from file (or from stdin, up to EOF or an empty line) and runs them with at most N
+* concurrent children (N=0 means one per online CPU). A slot is refilled as soon as one of the children exits.
+* With -k the stdout of every job is kept in a temporary file and printed in input order, so the output of
+* different jobs is never interleaved. The number of jobs, failures and the aggregate wall time go to stderr.
+*/
+static int parallel_jobs(int count, char **arglist){
+
+	int keep = 0;
+	int argi = 1;
+	long slots;
+	char *end;
+	FILE *in = stdin;
+	
+	if (argi < count && !strcmp(arglist[argi], "-k")) {
+		keep = 1;
+		argi++;
+	}
+	if (argi >= count || count - argi > 2) {
+		fprintf(stderr, "usage: parallel [-k] N [file]\n");
+		return 1;
+	}
+	slots = strtol(arglist[argi], &end, 10);
+	if (*end != '\0' || slots < 0) {
+		fprintf(stderr, "parallel: bad job count '%s'\n", arglist[argi]);
+		return 1;
+	}
+	if (slots == 0)
+		slots = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	if (argi + 1 < count && (in = fopen(arglist[argi + 1], "r")) == NULL) {
+		fprintf(stderr, "%s: %s\n", arglist[argi + 1], strerror(errno));
+		return 1;
+	}
+	
+	/* 
+	* with -k finished jobs wait in the ring until every older job is printed, so the ring is larger than
+	* the number of slots; this bounds the number of temporary files kept open behind one slow job.
+	*/
+	long ring = keep ? 4 * slots : slots;
+	struct job *jobs = calloc(ring, sizeof(struct job));
+	if (jobs == NULL) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		exit(1);
+	}
+	long started = 0, flushed = 0, running = 0, failed = 0;
+	char *line = NULL;
+	size_t size = 0;
+	int eof = 0;
+	double t0 = now_sec();
+	
+	/* children must stay waitable so that slots can be refilled as soon as they exit */
+	fg_begin();
+	interrupted = 0; /* only a SIGINT during this run cuts the -k output short */
+	
+	while (!eof || running > 0) {
+		/* fill free slots */
+		while (!eof && running < slots && started - flushed < ring) {
+			if (getline(&line, &size, in) == -1 || (in == stdin && line[0] == '\n')) {
+				eof = 1;
+				break;
+			}
+			struct job *j = &jobs[started % ring];
+			j->out = NULL;
+			if (keep && (j->out = tmpfile()) == NULL) {
+				fprintf(stderr, "%s\n", strerror(errno));
+				exit(1);
+			}
+			j->pid = job_start(line, j->out);
+			j->status = 0;
+			started++;
+			running++;
+		}
+		if (running == 0)
+			continue;
+			
+		/* wait for any child; background children of the shell may show up here too */
+		int status;
+		struct rusage ru;
+		pid_t pid = wait4(-1, &status, 0, &ru);
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s\n", strerror(errno));
+			exit(1);
+		}
+		for (long s = flushed; s < started; s++) {
+			struct job *j = &jobs[s % ring];
+			if (j->pid == pid) {
+				j->pid = 0;
+				j->status = status;
+				add_usage(&fg_usage, &ru);
+				running--;
+				if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+					failed++;
+				break;
+			}
+		}
+		/* retire finished jobs in input order */
+		while (flushed < started && jobs[flushed % ring].pid == 0) {
+			struct job *j = &jobs[flushed % ring];
+			if (j->out != NULL) {
+				rewind(j->out);
+				fflush(stdout); /* nothing the shell buffered may land between the raw writes */
+				if (move_fd(fileno(j->out), 1) == -1) {
+					fprintf(stderr, "parallel: output of job %ld: %s\n", flushed + 1, strerror(errno));
+					if (WIFEXITED(j->status) && WEXITSTATUS(j->status) == 0)
+						failed++; /* a job whose output was lost did not succeed */
+				}
+				fclose(j->out);
+			}
+			flushed++;
+		}
+	}
+	
+	fg_end();
+	
+	fprintf(stderr, "parallel: %ld jobs, %ld failed, %.3f s wall\n", started, failed, now_sec() - t0);
+	free(line);
+	free(jobs);
+	if (in != stdin)
+		fclose(in);
+	return 1;
+}
+
+/* run one command line: a pipe, an output redirection, a background command or a plain command */
+static int run_command(int count, char **arglist){
+	
+	int npipes = 0;
+	
+	/* builtins */
+	if (!strcmp(arglist[0], "parallel"))
+		return parallel_jobs(count, arglist);
+	if (!strcmp(arglist[0], "pipesize"))
+		return pipesize_builtin(count, arglist);
+	
+	/* pipe symbols '|' count */
 	for(int i=1; i<count-1; i++){
 		if (!strcmp(arglist[i],"|")){
-			pipe_ind = i;
-			break;
+			if (!strcmp(arglist[i-1],"|")) {
+				fprintf(stderr, "syntax error near '|'\n");
+				return 1;
+			}
+			npipes++;
 		}
 	}
 	
-	/* Single piping
-	* runing two child processes concurrently, with the standard output of the first process (executing the command that 
-	* appears before the pipe symbol) piped to the input (stdin) of the second process (executing the 
-	* command that appears after the pipe symbol). 
-	* The shell waits until both commands complete before accepting another command.
+	/* Piping
+	* runing the commands between the pipe symbols as concurrent child processes, with the standard output of each
+	* process piped to the input (stdin) of the next one. Every command may start with an @cpulist to pin it,
+	* and the pipes get the size set by the pipesize builtin.
+	* The shell waits until all commands complete before accepting another command.
 	*/
-	if (pipe_ind != 0){    
+	if (npipes != 0){    
 	
-		arglist[pipe_ind]=NULL; /* getting the first command (before the pipe symbol) */
-		int pfds[2];
-    	if (pipe(pfds) == -1) { /* piping */
-    		fprintf(stderr, "%s\n", strerror(errno));
-    		exit(1);
-    	}
-    	
-   		pid_t pid = fork();
-   		
-    	if (pid == -1) {
-    		fprintf(stderr, "%s\n", strerror(errno));
-    		exit(1);
-    	}
-    	else if (pid == 0){ /* child */
-    		
-    		if (dup2(pfds[1], 1) == -1) { /* piping the standard output of the first process */
-    			fprintf(stderr, "%s\n", strerror(errno));
-    			exit(1);
-    		}
-        	close(pfds[0]);
-        	close(pfds[1]);
-        	if (execvp(arglist[0], arglist) == -1) { /* execute first command */
-    			fprintf(stderr, "%s: %s\n", arglist[0], strerror(errno));
-    			exit(1);
-    		}    	
-    	}
-    	else{ /* parent */
-    		signal(SIGCHLD, SIG_IGN); /* zombie processes prevention */
-    		
-        	pid_t pid2 = fork();
-        	
-       		if (pid2 == -1) {
-    			fprintf(stderr, "%s\n", strerror(errno));
-    			exit(1);
-    		}
-        	else if (pid2 == 0){ /* child */
-            	if (dup2(pfds[0], 0) == -1) { /* piping the standard input of the second process */
-    				fprintf(stderr, "%s\n", strerror(errno));
-    				exit(1);
-    			}
-            	close(pfds[0]);
-            	close(pfds[1]); 
-            	if (execvp(arglist[pipe_ind + 1], arglist + (pipe_ind + 1)) == -1) { /* execute second command (after the pipe symbol)*/
-            		fprintf(stderr, "%s: %s\n", arglist[pipe_ind + 1], strerror(errno));
-    				exit(1);
-    			}
-        	}
-        	else{ /* parent (shell) */
-        		signal(SIGCHLD, SIG_IGN); /* zombie processes prevention */
-            	close(pfds[0]);
-            	close(pfds[1]); 
-            	/* waiting for both processes to complete */
-            	if(waitpid(pid, NULL, WUNTRACED)==-1 && errno!=EINTR && errno!=ECHILD){
-					fprintf(stderr, "%s\n", strerror(errno));
-					exit(1); 
-				}	
-				if(waitpid(pid2, NULL, WUNTRACED)==-1 && errno!=EINTR && errno!=ECHILD){
+		pid_t pids[npipes + 1];
+		int nstages = 0;
+		int prev_read = -1; /* read end of the pipe feeding the next stage */
+		
+    	fg_begin();
+		for (int start = 0; start < count; nstages++) {
+			int end = start;
+			while (end < count && (strcmp(arglist[end], "|") || end == 0 || end == count - 1))
+				end++;
+			arglist[end] = NULL; /* getting this command (before the pipe symbol) */
+			
+			int pfds[2] = {-1, -1};
+			if (end < count) {
+				if (pipe(pfds) == -1) { /* piping */
 					fprintf(stderr, "%s\n", strerror(errno));
-					exit(1); 
-				}	
-            	return 1;
-        	}
-    	}
+					exit(1);
+				}
+				if (pipe_size != 0 && fcntl(pfds[1], F_SETPIPE_SZ, pipe_size) == -1)
+					fprintf(stderr, "pipesize %d: %s\n", pipe_size, strerror(errno));
+			}
+			pids[nstages] = launch(arglist + start, prev_read, pfds[1], 0);
+			if (prev_read != -1)
+				close(prev_read);
+			if (pfds[1] != -1)
+				close(pfds[1]);
+			prev_read = pfds[0];
+			start = end + 1;
+		}
+    	/* waiting for all processes to complete */
+    	for (int i = 0; i < nstages; i++)
+    		wait_fg(pids[i]);
+    	fg_end(); /* zombie processes prevention */
+    	return 1;
 	}
 	/* Output redirecting 
 	* creat/open the specified file (that appears after the redirection symbol) and then run the child process, 
@@ -148,6 +927,10 @@ int process_arglist(int count, char **arglist){
 	*/
 	else if (count >1 && !strcmp(arglist[count -2],">")){ 
 	
+		if (count == 2) { /* nothing before the redirection symbol */
+			fprintf(stderr, "syntax error near '>'\n");
+			return 1;
+		}
   		int fd = open(arglist[count -1], O_RDWR | O_CREAT, 0644); /* overwriting/creating output file */
   		
   		if (-1 == fd) {
@@ -155,84 +938,176 @@ int process_arglist(int count, char **arglist){
     		exit(1);
   		}
   		arglist[count-2]=NULL;	/* getting the command (before the redirection symbol) */
-		pid_t pid =fork();
-		if (pid==-1){ 
-			fprintf(stderr, "%s\n", strerror(errno));
-			close(fd);
-			exit(1);
-		}
-		else if (pid==0){ /*child*/
-			if (dup2(fd, 1) == -1) { /* redirect standard output of the process to the output file*/
-    			fprintf(stderr, "%s\n", strerror(errno));
-    			close(fd);
-    			exit(1);
-    		}
-			if (execvp(arglist[0], arglist) == -1) { /* execute command */
-    			fprintf(stderr, "%s: %s\n", arglist[0], strerror(errno));
-    			close(fd);
-    			exit(1);
-    		}
-		}
-		else{ /*parent*/
-  			signal(SIGCHLD, SIG_IGN); /* zombie processes prevention */
-			if(waitpid(pid, NULL, WUNTRACED)==-1 && errno!=EINTR && errno!=ECHILD){ /* waiting for the command (child process) to complete */
-				fprintf(stderr, "%s\n", strerror(errno));
-				exit(1); 
-			}
-			close(fd);
-			return 1;	
-		}		
+  		if (is_builtin_cat(arglist)) { /* builtin cat copies into the file without forking */
+  			cat_files(arglist, fd);
+  			close(fd);
+  			return 1;
+  		}
+  		fg_begin();
+		pid_t pid = launch(arglist, -1, fd, 0); /* redirect standard output of the process to the output file*/
+		wait_fg(pid); /* waiting for the command (child process) to complete */
+		fg_end(); /* zombie processes prevention */
+		close(fd);
+		return 1;	
 	}
 	/* Executing command in the background */
 	else if (!strcmp(arglist[count -1],"&")){
 	
 		arglist[count -1] = NULL; /* getting the command (before the "&" symbol) */
-		
-		pid_t pid =fork();
-		
-		if (pid==-1){ 
-			fprintf(stderr, "%s\n", strerror(errno));
-			exit(1);
-		}
-		else if (pid==0){ /*child*/ 
-			background_sig_pro();	/* Background child processes should not terminate upon SIGINT */
-			if (execvp(arglist[0], arglist) == -1) { /* execute command in the background */
-    			fprintf(stderr, "%s: %s\n", arglist[0], strerror(errno));
-    			exit(1);
-    		}
-		}
-		else{  /*parent*/
-			signal(SIGCHLD, SIG_IGN); /* zombie processes prevention */
-			return 1; /* The parent should not wait for the child process to finish, but instead continue executing commands.*/
+		if (arglist[0] == NULL) {
+			fprintf(stderr, "syntax error near '&'\n");
+			return 1;
 		}
+		launch(arglist, -1, -1, 1);
+		signal(SIGCHLD, SIG_IGN); /* zombie processes prevention */
+		return 1; /* The parent should not wait for the child process to finish, but instead continue executing commands.*/
 	}
 	/* Executing command */
+	else if (is_builtin_cat(arglist)){
+		cat_files(arglist, 1);
+		return 1;
+	}
 	else{
-		pid_t pid =fork();
+		fg_begin();
+		pid_t pid = launch(arglist, -1, -1, 0);
+		wait_fg(pid); /* waiting for the command (child process) to complete */
+		fg_end(); /* zombie processes prevention */
+		return 1;
+	}
+	return 0;	
+}
+
+/* Per-command timing
+* "time cmd ..." prints the wall, user and sys time and the peak RSS of one command to stderr.
+* With timing enabled (shell -T) every foreground command is measured the same way, the TIME_TOP slowest
+* are kept and finalize() prints them sorted, slowest first.
+*/
+#define TIME_TOP 20
+
+struct cmd_time {
+	char *cmd;
+	double wall, user, sys;
+	long maxrss; /* KB */
+};
+
+static int timing;
+static struct cmd_time slowest[TIME_TOP];
+static int nslowest;
+static long ntimed;
+static double total_wall;
+
+void enable_timing(void){
+	timing = 1;
+}
+
+/* keep t if it is among the TIME_TOP slowest commands so far */
+static void record_time(struct cmd_time *t, char **arglist, int count){
+
+	int slot = nslowest;
+	
+	ntimed++;
+	total_wall += t->wall;
+	if (nslowest == TIME_TOP) {
+		slot = 0;
+		for (int i = 1; i < TIME_TOP; i++)
+			if (slowest[i].wall < slowest[slot].wall)
+				slot = i;
+		if (slowest[slot].wall >= t->wall)
+			return;
+		free(slowest[slot].cmd);
+	}
+	else
+		nslowest++;
 		
-		if (pid==-1){ 
-			fprintf(stderr, "%s\n", strerror(errno));
-			exit(1);
-		}
-		else if (pid==0) { /*child*/
-		    
-			if (execvp(arglist[0], arglist) == -1) { /* execute command */
-    			fprintf(stderr, "%s: %s\n", arglist[0], strerror(errno));
-    			exit(1);
-    		}
-    	}
-		else{ /*parent*/
-			signal(SIGCHLD, SIG_IGN); /* zombie processes prevention */
-			if(waitpid(pid, NULL, WUNTRACED)==-1 && errno!=EINTR && errno!=ECHILD){ /* waiting for the command (child process) to complete */
-				fprintf(stderr, "%s\n", strerror(errno));
-				exit(1); 
-			}
+	/* the command text is only rebuilt for commands that make the list */
+	size_t len = 1;
+	for (int i = 0; i < count; i++)
+		len += strlen(arglist[i]) + 1;
+	t->cmd = malloc(len);
+	if (t->cmd == NULL) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		exit(1);
+	}
+	t->cmd[0] = '\0';
+	for (int i = 0; i < count; i++) {
+		strcat(t->cmd, arglist[i]);
+		if (i + 1 < count)
+			strcat(t->cmd, " ");
+	}
+	slowest[slot] = *t;
+}
+
+static int by_wall_desc(const void *a, const void *b){
+	double d = ((const struct cmd_time*)b)->wall - ((const struct cmd_time*)a)->wall;
+	return (d > 0) - (d < 0);
+}
+
+/* 
+* arglist - a list of char* arguments (words) provided by the user
+* it contains count+1 items, where the last item (arglist[count]) and *only* the last is NULL
+* RETURNS - 1 if should continue, 0 otherwise 
+*/
+int process_arglist(int count, char **arglist){
+
+	int timed = 0;
+	
+	if (!strcmp(arglist[0], "time")) {
+		if (count == 1) {
+			fprintf(stderr, "usage: time command [args...]\n");
 			return 1;
 		}
+		timed = 1;
+		arglist++;
+		count--;
 	}
-	return 0;	
+	/* background commands are not waited for, there is nothing to measure */
+	if ((!timing && !timed) || !strcmp(arglist[count - 1], "&"))
+		return run_command(count, arglist);
+		
+	/* run_command() overwrites operators with NULL, keep the words for the report */
+	char **words = malloc(sizeof(char*) * (count + 1));
+	if (words == NULL) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		exit(1);
+	}
+	memcpy(words, arglist, sizeof(char*) * (count + 1));
+	
+	/* builtins run inside the shell, so its own usage counts too */
+	struct rusage self0, self1;
+	struct cmd_time t;
+	getrusage(RUSAGE_SELF, &self0);
+	memset(&fg_usage, 0, sizeof(fg_usage));
+	double t0 = now_sec();
+	
+	int ret = run_command(count, arglist);
+	
+	t.wall = now_sec() - t0;
+	getrusage(RUSAGE_SELF, &self1);
+	t.user = tv_sec(fg_usage.ru_utime) + tv_sec(self1.ru_utime) - tv_sec(self0.ru_utime);
+	t.sys = tv_sec(fg_usage.ru_stime) + tv_sec(self1.ru_stime) - tv_sec(self0.ru_stime);
+	t.maxrss = fg_usage.ru_maxrss;
+	if (timed)
+		fprintf(stderr, "real %.3fs  user %.3fs  sys %.3fs  maxrss %ld KB\n", t.wall, t.user, t.sys, t.maxrss);
+	if (timing)
+		record_time(&t, words, count);
+	free(words);
+	return ret;
 }
 
 int finalize(void){
+
+	if (zygote_fd != -1)
+		close(zygote_fd); /* the helper leaves on EOF */
+
+	if (timing && ntimed > 0) {
+		qsort(slowest, nslowest, sizeof(struct cmd_time), by_wall_desc);
+		fprintf(stderr, "%ld commands, %.3fs total wall; slowest:\n", ntimed, total_wall);
+		fprintf(stderr, "%10s %10s %10s %12s  %s\n", "wall(s)", "user(s)", "sys(s)", "maxrss(KB)", "command");
+		for (int i = 0; i < nslowest; i++) {
+			fprintf(stderr, "%10.3f %10.3f %10.3f %12ld  %s\n", slowest[i].wall, slowest[i].user, slowest[i].sys,
+				slowest[i].maxrss, slowest[i].cmd);
+			free(slowest[i].cmd);
+		}
+	}
 	return 0;
 }
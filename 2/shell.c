@@ -3,6 +3,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tokenizer.h"
 
 // arglist - a list of char* arguments (words) provided by the user
 // it contains count+1 items, where the last item (arglist[count]) and *only* the last is NULL
@@ -13,53 +18,92 @@ int process_arglist(int count, char** arglist);
 int prepare(void);
 int finalize(void);
 
-int main(void)
+// -T: time every foreground command, finalize() prints the slowest ones
+void enable_timing(void);
+
+// -Z: launch commands through a pre-forked helper (must be called before prepare)
+void enable_zygote(void);
+
+// run every line of a script file; the file is mapped and parsed in place, lines are never copied
+static int run_script(const char* path, struct tok_arena* arena)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return 1;
+	}
+	const char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	close(fd);
+	madvise((void*) map, st.st_size, MADV_SEQUENTIAL);
+
+	int cont = 1;
+	const char* end = map + st.st_size;
+	for (const char* p = map; p < end && cont; ) {
+		const char* nl = memchr(p, '\n', end - p);
+		size_t len = (nl ? nl : end) - p;
+		char** arglist;
+		int count = tokenize(arena, p, len, &arglist);
+
+		if (count == -1)
+			fprintf(stderr, "syntax error: unterminated quote\n");
+		else if (count != 0)
+			cont = process_arglist(count, arglist);
+		p += len + 1;
+	}
+	munmap((void*) map, st.st_size);
+	return cont;
+}
+
+int main(int argc, char* argv[])
 {
+	struct tok_arena arena = {0}; // reused by every line, see tokenizer.h
+	char* line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "TZ")) != -1) {
+		if (opt == 'T')
+			enable_timing();
+		else if (opt == 'Z')
+			enable_zygote();
+		else {
+			fprintf(stderr, "usage: %s [-T] [-Z] [script]\n", argv[0]);
+			exit(1);
+		}
+	}
+
 	if (prepare() != 0)
 		exit(1);
 	
-	while (1)
+	if (optind < argc)
+		run_script(argv[optind], &arena);
+	else while ((len = getline(&line, &size, stdin)) != -1)
 	{
-		char** arglist = NULL;
-		char* line = NULL;
-		size_t size;
-		int count = 0;
+		char** arglist;
+		int count = tokenize(&arena, line, len, &arglist);
 
-		if (getline(&line, &size, stdin) == -1) {
-			free(line);
-			break;
+		if (count == -1) {
+			fprintf(stderr, "syntax error: unterminated quote\n");
+			continue;
 		}
-    
-		arglist = (char**) malloc(sizeof(char*));
-		if (arglist == NULL) {
-			printf("malloc failed: %s\n", strerror(errno));
-			exit(1);
-		}
-		arglist[0] = strtok(line, " \t\n");
-    
-		while (arglist[count] != NULL) {
-			++count;
-			arglist = (char**) realloc(arglist, sizeof(char*) * (count + 1));
-			if (arglist == NULL) {
-				printf("realloc failed: %s\n", strerror(errno));
-				exit(1);
-			}
-      
-			arglist[count] = strtok(NULL, " \t\n");
-		}
-    
-		if (count != 0) {
-			if (!process_arglist(count, arglist)) {
-				free(line);
-				free(arglist);
-				break;
-			}
-		}
-    
-		free(line);
-		free(arglist);
+		if (count != 0 && !process_arglist(count, arglist))
+			break;
 	}
 	
+	free(line);
+	tok_arena_free(&arena);
+
 	if (finalize() != 0)
 		exit(1);
 
@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+/*
+* Launch latency of the shell as its RSS grows: plain fork() against the -Z zygote.
+* Links the real shell code and calls process_arglist() the way shell.c does, growing the heap between rounds.
+*
+* gcc -O3 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 -o spawn_bench spawn_bench.c myshell.c tokenizer.c
+* ./spawn_bench [-n launches] [rss_mb ...]
+*/
+
+int process_arglist(int count, char **arglist);
+int prepare(void);
+int finalize(void);
+void enable_zygote(void);
+
+static double now_sec(void){
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* one mode, in its own process so the zygote is forked while the heap is still small */
+static void run_mode(int zygote, int launches, int nsizes, long *sizes_mb){
+
+	size_t grown = 0;
+
+	if (zygote)
+		enable_zygote();
+	if (prepare() != 0)
+		exit(1);
+	for (int s = 0; s < nsizes; s++) {
+		size_t want = (size_t) sizes_mb[s] << 20;
+		if (want > grown) { /* touched, so it really is resident and fork has to copy its page tables */
+			char *ballast = malloc(want - grown);
+			if (ballast == NULL) {
+				fprintf(stderr, "malloc failed: %s\n", strerror(errno));
+				exit(1);
+			}
+			memset(ballast, 1, want - grown);
+			grown = want;
+		}
+		double t0 = now_sec();
+		for (int i = 0; i < launches; i++) {
+			char *argv[] = {"true", NULL};
+			process_arglist(1, argv);
+		}
+		printf("%-8s %8ld %12.1f\n", zygote ? "zygote" : "fork", sizes_mb[s], (now_sec() - t0) / launches * 1e6);
+		fflush(stdout);
+	}
+	finalize();
+	exit(0);
+}
+
+int main(int argc, char *argv[]){
+
+	long default_sizes[] = {0, 256, 1024, 4096};
+	long *sizes = default_sizes;
+	int nsizes = sizeof(default_sizes) / sizeof(long);
+	int launches = 1000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		if (opt != 'n') {
+			fprintf(stderr, "usage: %s [-n launches] [rss_mb ...]\n", argv[0]);
+			exit(1);
+		}
+		launches = atoi(optarg);
+	}
+	if (optind < argc) {
+		nsizes = argc - optind;
+		sizes = malloc(sizeof(long) * nsizes);
+		for (int i = 0; i < nsizes; i++)
+			sizes[i] = atol(argv[optind + i]);
+	}
+
+	printf("%-8s %8s %12s\n", "mode", "rss_mb", "us/launch");
+	fflush(stdout);
+	for (int zygote = 0; zygote <= 1; zygote++) {
+		pid_t pid = fork();
+		if (pid == -1) {
+			fprintf(stderr, "%s\n", strerror(errno));
+			exit(1);
+		}
+		if (pid == 0)
+			run_mode(zygote, launches, nsizes, sizes);
+		waitpid(pid, NULL, 0);
+	}
+	return 0;
+}
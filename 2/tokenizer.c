@@ -0,0 +1,100 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "tokenizer.h"
+
+/*
+* A line of len bytes has at most len words (plus the terminating NULL) and at most 2*len+1 bytes of
+* word text (every word costs its characters plus a '\0', and quotes/escapes only shrink it), so one
+* reservation up front means the parse itself never reallocates.
+*/
+static void arena_reserve(struct tok_arena *arena, size_t len){
+
+	size_t need = (len + 1) * sizeof(char*) + 2 * len + 1;
+	size_t cap = arena->cap ? arena->cap : 256;
+
+	if (need <= arena->cap)
+		return;
+	while (cap < need)
+		cap *= 2;
+	free(arena->buf); /* the contents only live for one line, nothing to carry over */
+	arena->buf = malloc(cap);
+	if (arena->buf == NULL) {
+		fprintf(stderr, "malloc failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	arena->cap = cap;
+}
+
+static int is_blank(char c){
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int is_operator(char c){
+	return c == '|' || c == '>' || c == '&';
+}
+
+int tokenize(struct tok_arena *arena, const char *line, size_t len, char ***argvp){
+
+	size_t i = 0;
+	int count = 0;
+
+	arena_reserve(arena, len);
+	char **argv = (char**) arena->buf;
+	char *out = arena->buf + (len + 1) * sizeof(char*);
+
+	while (1) {
+		while (i < len && is_blank(line[i]))
+			i++;
+		if (i == len)
+			break;
+		argv[count++] = out;
+
+		if (is_operator(line[i])) { /* operators are words by themselves */
+			*out++ = line[i++];
+			*out++ = '\0';
+			continue;
+		}
+		while (i < len && !is_blank(line[i]) && !is_operator(line[i])) {
+			char c = line[i++];
+			if (c == '\'') { /* everything up to the closing quote, literally */
+				const char *close = memchr(line + i, '\'', len - i);
+				if (close == NULL)
+					return -1;
+				memcpy(out, line + i, close - (line + i));
+				out += close - (line + i);
+				i = close - line + 1;
+			}
+			else if (c == '"') { /* like single quotes, but \" and \\ are escapes */
+				while (i < len && line[i] != '"') {
+					if (line[i] == '\\' && i + 1 < len && (line[i + 1] == '"' || line[i + 1] == '\\'))
+						i++;
+					*out++ = line[i++];
+				}
+				if (i == len)
+					return -1;
+				i++;
+			}
+			else if (c == '\\') { /* escaped character (a trailing backslash is dropped) */
+				if (i < len)
+					*out++ = line[i++];
+			}
+			else {
+				*out++ = c;
+			}
+		}
+		*out++ = '\0';
+	}
+	argv[count] = NULL;
+	*argvp = argv;
+	return count;
+}
+
+void tok_arena_free(struct tok_arena *arena){
+
+	free(arena->buf);
+	arena->buf = NULL;
+	arena->cap = 0;
+}
@@ -0,0 +1,29 @@
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include <stddef.h>
+
+/*
+* Per-line arena for the tokenizer: a single allocation holding the argv array followed by the
+* token text. It only grows (geometrically) and is reused for every line, so steady-state parsing
+* does no allocation at all. Zero-initialize before the first use.
+*/
+struct tok_arena {
+	char *buf;
+	size_t cap;
+};
+
+/*
+* Splits line[0..len) into words. Words are separated by blanks; single quotes keep everything
+* literally, double quotes keep everything but \" and \\, and a backslash outside quotes escapes
+* the next character. The operators | > & are words of their own even without surrounding blanks
+* ("a|b>c" is "a" "|" "b" ">" "c"). Note that a quoted operator standing alone ("|") still reads
+* as that operator to process_arglist, which only sees strings.
+* argvp - receives the NULL terminated word list, valid until the next call on the same arena
+* RETURNS - the number of words, or -1 on an unterminated quote
+*/
+int tokenize(struct tok_arena *arena, const char *line, size_t len, char ***argvp);
+
+void tok_arena_free(struct tok_arena *arena);
+
+#endif
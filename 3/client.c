@@ -7,43 +7,106 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <endian.h>
+#include <sys/stat.h>
 
 /*
 The client creates a TCP connection to the server and sends it the contents
 of a user-supplied file. The client then reads back the count of printable characters from the
 server, prints it, and exits.
+
+Usage: client [-c] <server_ip> <server_port> <file>
+A file of known size under 4 GB is sent as one body after its 32-bit size. Anything else (- for stdin,
+a pipe, a bigger file, or any file with -c) is streamed in chunked framing, see server.c, so it never
+has to be staged to disk first: zcat huge.gz | client 127.0.0.1 port -
 */
 
+#define CHUNKED 0xFFFFFFFFu // N announcing a chunked body
+
+// Write all len bytes to the server, however short the single writes are
+void write_all(int sock, const void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t bytes_written = write(sock, buf, len);
+        if (bytes_written < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error sending file contents");
+            exit(1);
+        }
+        buf = (const char *) buf + bytes_written;
+        len -= bytes_written;
+    }
+}
+
+// Read exactly len bytes of the reply from the server
+void read_all(int sock, void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t bytes_read = read(sock, buf, len);
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error receiving printable count");
+            exit(1);
+        }
+        if (bytes_read == 0) {
+            fprintf(stderr, "Error: server closed the connection\n");
+            exit(1);
+        }
+        buf = (char *) buf + bytes_read;
+        len -= bytes_read;
+    }
+}
+
 int main(int argc, char *argv[]) {
     int sock;
-    int bytes_read;
+    size_t bytes_read;
     FILE *file;
     char *server_ip;
     char *file_path;
-    char buffer[1048576]; // Allocations of up to 1 MB are OK.
+    static char buffer[8 + 1048576]; // Allocations of up to 1 MB are OK (+ room for a chunk's length).
+    char *data = buffer + 8;
     uint16_t server_port; // Port number can be represented with a 16-bit unsigned integer. 
-    uint32_t file_size; // The size of the file can be represented with a 32-bit unsigned integer.
-    uint32_t file_size_n;
-    uint32_t printable_count; // The count of printable characters can be represented with a 32-bit unsigned integer.
+    uint32_t file_size_n; // The size of the file (or CHUNKED) as a 32-bit unsigned integer.
+    uint64_t chunk_size_n;
+    uint64_t printable_count; // The count of printable characters, 64 bits when chunked
     uint32_t printable_count_n;
+    uint64_t printable_count_n64;
     struct sockaddr_in server_addr;
+    struct stat file_stat;
+    int chunked = 0; // -c, or whenever the size isn't known up front or doesn't fit 32 bits
+    int opt;
 
     // Validate command line arguments
-    if (argc != 4) {
+    while ((opt = getopt(argc, argv, "c")) != -1) {
+        if (opt == 'c') {
+            chunked = 1;
+        } else {
+            fprintf(stderr, "Error: usage: %s [-c] <server_ip> <server_port> <file>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 3) {
         fprintf(stderr, "Error: Invalid number of command line arguments.\n");
         exit(1);
     }
 
-    server_ip = argv[1];
-    server_port = atoi(argv[2]);
-    file_path = argv[3];
+    server_ip = argv[optind];
+    server_port = atoi(argv[optind + 1]);
+    file_path = argv[optind + 2];
 
-    // Open the specified file for reading
-    file = fopen(file_path, "r");
+    // Open the specified file for reading, - is stdin
+    file = strcmp(file_path, "-") == 0 ? stdin : fopen(file_path, "r");
     if (file == NULL) {
         perror("Error opening file");
         exit(1);
     }
+    if (fstat(fileno(file), &file_stat) < 0) {
+        perror("Error reading file size");
+        exit(1);
+    }
+    if (!S_ISREG(file_stat.st_mode) || (uint64_t) file_stat.st_size >= CHUNKED) {
+        chunked = 1;
+    }
 
     // Create a TCP connection to the specified server port on the specified server IP.
     sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -65,33 +128,39 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    // Get the size of the file 
-    fseek(file, 0, SEEK_END);
-    file_size = ftell(file);
-    rewind(file);
-    // Send the server the number of bytes that will be transferred (i.e., the file size).
-    file_size_n = htonl((uint32_t) file_size); // Convert from host byte order to network byte order.
-    if (write(sock, &file_size_n, sizeof(file_size_n)) < 0) { // Send the file size
-        perror("Error sending file size");
+    // Send the server the number of bytes that will be transferred (i.e., the file size), or CHUNKED.
+    file_size_n = htonl(chunked ? CHUNKED : (uint32_t) file_stat.st_size); // Convert from host byte order to network byte order.
+    write_all(sock, &file_size_n, sizeof(file_size_n));
+    // Sends the server the contents of the file, each chunk after its length when chunked.
+    while ((bytes_read = fread(data, 1, sizeof(buffer) - 8, file)) > 0) {
+        if (chunked) {
+            chunk_size_n = htobe64(bytes_read);
+            memcpy(buffer, &chunk_size_n, sizeof(chunk_size_n)); // one write for the length and the chunk
+            write_all(sock, buffer, 8 + bytes_read);
+        } else {
+            write_all(sock, data, bytes_read);
+        }
+    }
+    if (ferror(file)) {
+        perror("Error reading file");
         exit(1);
     }
-    // Sends the server the contents of the file.
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-        if (write(sock, buffer, bytes_read) < 0) {
-            perror("Error sending file contents");
-            exit(1);
-        }
+    if (chunked) { // the zero-length chunk ends the body
+        chunk_size_n = 0;
+        write_all(sock, &chunk_size_n, sizeof(chunk_size_n));
     }
 
     // Receive the count of printable characters from the server
-    if (read(sock, &printable_count_n, sizeof(printable_count_n)) < 0){
-        perror("Error receiving printable count");
-        exit(1);
+    if (chunked) {
+        read_all(sock, &printable_count_n64, sizeof(printable_count_n64));
+        printable_count = be64toh(printable_count_n64); // Convert from network byte order to host byte order.
+    } else {
+        read_all(sock, &printable_count_n, sizeof(printable_count_n));
+        printable_count = ntohl(printable_count_n); // Convert from network byte order to host byte order.
     }
-    printable_count = ntohl(printable_count_n); // Convert from network byte order to host byte order.
 
     // Print the number of printable characters
-    printf("# of printable characters: %u\n", printable_count);
+    printf("# of printable characters: %lu\n", printable_count);
     
     // Close the file and socket
     fclose(file);
@@ -0,0 +1,203 @@
+#ifndef PCC_H
+#define PCC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PCC_NCHARS 95 /* printable chars are 32..126, counted at index c-32 */
+
+/*
+* one worker's share of the statistics, padded to whole cache lines so workers never write the same line.
+* Only its worker writes it (pcc_commit()), inside a seqlock: seq is odd while a commit is under way, so a
+* reader (pcc_shard_read()) retries instead of seeing half of a connection's counts, and never blocks the worker.
+*/
+struct pcc_shard {
+    uint64_t seq;
+    uint64_t requests; /* requests answered */
+    uint64_t count[PCC_NCHARS];
+} __attribute__((aligned(64)));
+
+/*
+* -x analytics beside the 95 bins: every byte value, and every pair of adjacent printable chars within a
+* request ([first - 32][second - 32]). A worker's totals are kept next to its shard, under its seqlock.
+*/
+struct pcc_xcounts {
+    uint64_t bytes[256];
+    uint64_t pairs[PCC_NCHARS * PCC_NCHARS];
+} __attribute__((aligned(64)));
+
+/*
+* a request's joint table (pcc_count_joint()): counters of every byte by the class of the byte before it,
+* [class << 8 | byte], class 0..94 for a printable char and PCC_NCHARS for anything else (or none).
+* Bytes go into 16-bit counters, small enough to stay in L1, added into the 32-bit ones every PCC_NARROW_MAX
+*/
+#define PCC_NCLASS (PCC_NCHARS + 1)
+#define PCC_JOINT_SIZE (PCC_NCLASS * 256)
+#define PCC_NARROW_MAX 65535 /* bytes into the 16-bit counters before they have to be widened */
+#define PCC_JOINT_MAX (1u << 30) /* bytes counted before the table has to be folded (pcc_joint_fold()) */
+
+struct pcc_joint {
+    uint16_t narrow[PCC_JOINT_SIZE];
+    uint32_t wide[PCC_JOINT_SIZE];
+    uint64_t counted; /* bytes since the last fold */
+    unsigned in_narrow; /* of them, still in narrow */
+    unsigned prev; /* class of the last byte counted, PCC_NCHARS at the start of a request */
+} __attribute__((aligned(64)));
+
+/* a connection's analytics, allocated on the first byte it counts (pcc_conn.c) */
+struct pcc_xconn {
+    struct pcc_joint joint; /* of the request being received */
+    struct pcc_xcounts* big; /* folded from joint so far, for a request of more than PCC_JOINT_MAX bytes */
+    struct pcc_xcounts unsent; /* of the requests whose C is in out[] */
+};
+
+/* a connection's deadline in an event loop's timer wheel (pcc_timer.c) */
+#define PCC_TICK_MS 100
+#define PCC_WHEEL_BITS 6
+#define PCC_WHEEL_SLOTS (1 << PCC_WHEEL_BITS)
+#define PCC_WHEEL_LEVELS 4
+struct pcc_timer {
+    struct pcc_timer *next, *prev; /* NULL when not armed */
+    uint64_t expires; /* tick */
+};
+struct pcc_wheel {
+    uint64_t now; /* tick the wheel is at */
+    unsigned armed;
+    struct pcc_timer slots[PCC_WHEEL_LEVELS][PCC_WHEEL_SLOTS]; /* list heads */
+};
+/* what a connection's deadline is running for (pcc_conn_deadline()) */
+enum pcc_wait { PCC_WAIT_NONE, PCC_WAIT_HEADER, PCC_WAIT_BODY, PCC_WAIT_REPLY };
+#define PCC_PROGRESS_BYTES 4096 /* body bytes that restart the deadline */
+
+/*
+* Protocol state of one connection, shared by every server loop (blocking workers and event loops):
+* the loop only moves bytes, pcc_conn_input() parses and counts them.
+*   PCC_HEADER - reading the 8-byte N (network byte order)
+*   PCC_BODY   - reading and counting the N bytes
+*   PCC_COUNTS - reading the total and 95 counters of a histogram the client counted itself (N == PCC_HIST)
+*   PCC_REPLY  - no more input for now: v1's C is in out[], or v2's out[] is full. Whatever the loop
+*                already received is kept in stash (v2) or dropped (v1) until out[] was sent.
+*
+* v1 is one request per connection. A client that opens with N == PCC_HELLO gets PCC_HELLO echoed
+* back and the connection switches to v2: any number of N-prefixed requests, which may be pipelined,
+* each answered by its C in order, until the client closes its side between two requests. A request's
+* counts are committed once its C was sent; N can't be PCC_HELLO for a real v1 request (>= 2^63 bytes).
+* Over a UNIX socket a request can be N == PCC_FD sent together with an open file (SCM_RIGHTS) instead
+* of a body: the server reads the file itself from its offset to its end and answers with its C. Only a
+* regular file is taken (a pipe or socket could keep the worker waiting forever); that, or an error
+* reading it, fails the connection like an error on the socket does.
+* A trusted client (the server runs with -a) can send N == PCC_HIST followed by its own counts instead
+* of a body: C, then the 95 counters (all 8 bytes, network byte order), answered with that C and
+* committed like any other request. Otherwise, or if the counters don't add up to C, the connection fails.
+*/
+enum pcc_state { PCC_HEADER, PCC_BODY, PCC_COUNTS, PCC_REPLY };
+
+#define PCC_HELLO 0xFFFFFFFF50434332ULL /* "....PCC2" */
+#define PCC_FD 0xFFFFFFFF50434346ULL /* "....PCCF", only with a passed file */
+#define PCC_HIST 0xFFFFFFFF50434348ULL /* "....PCCH" */
+#define PCC_OUT_MAX 64 /* v2 replies queued before the connection stops taking input */
+
+struct pcc_conn {
+    int fd;
+    enum pcc_state state;
+    int v2; /* negotiated persistent connection */
+    int eof; /* client closed its side, v2 finishes once out[] and stash are done */
+    int failed; /* protocol error: the loop closes the connection without answering */
+    unsigned have; /* header (or PCC_COUNTS counter) bytes received so far */
+    unsigned words; /* PCC_COUNTS counters received so far, C first */
+    unsigned char hdr[8];
+    uint64_t remaining; /* body bytes still to come */
+    uint64_t printable; /* printable chars seen so far in this request */
+    uint64_t hist[PCC_NCHARS]; /* counts of the request being received */
+    uint64_t unsent[PCC_NCHARS]; /* counts of the requests whose C is in out[], committed only once it was sent */
+    uint64_t unsent_requests; /* how many requests that is */
+    unsigned char out[8 * PCC_OUT_MAX]; /* C's in network byte order */
+    unsigned out_len, out_off;
+    char* stash; /* v2 input received while in PCC_REPLY */
+    size_t stash_len, stash_off;
+    int* fds; /* files passed for PCC_FD requests not parsed yet, oldest first */
+    unsigned nfds;
+    struct pcc_timer timer; /* event loops: dropped when it expires */
+    enum pcc_wait waiting; /* what timer was armed for */
+    uint64_t received; /* bytes fed so far */
+    uint64_t queued; /* replies queued so far */
+    uint64_t received_armed, queued_armed; /* when timer was armed */
+    struct pcc_xconn* x; /* -x only */
+};
+
+/* pcc_conn.c */
+extern int pcc_accept_hist;
+extern int pcc_analytics;
+void pcc_conn_reset(struct pcc_conn* conn, int fd);
+size_t pcc_conn_input(struct pcc_conn* conn, const char* buf, size_t len);
+size_t pcc_conn_want(const struct pcc_conn* conn);
+void pcc_conn_feed(struct pcc_conn* conn, const char* buf, size_t len);
+int pcc_conn_sent(struct pcc_conn* conn);
+int pcc_conn_eof(struct pcc_conn* conn);
+void pcc_conn_free(struct pcc_conn* conn);
+void pcc_conn_add(struct pcc_conn* conn, uint64_t len, uint64_t printable, const uint64_t* hist);
+void pcc_conn_pass_fd(struct pcc_conn* conn, int fd);
+int is_client_error(int err);
+
+/* pcc_count.c */
+typedef uint64_t (*pcc_count_fn)(const unsigned char* buf, size_t len, uint64_t* hist);
+struct pcc_counter {
+    const char* name;
+    pcc_count_fn count;
+    int (*supported)(void);
+};
+extern const struct pcc_counter pcc_counters[]; /* every variant built in, best first, NULL name at the end */
+uint64_t pcc_count(const unsigned char* buf, size_t len, uint64_t* hist);
+uint64_t pcc_count_bytes(const unsigned char* buf, size_t len, uint64_t* hist);
+void pcc_count_joint(struct pcc_joint* j, const unsigned char* buf, size_t len);
+void pcc_joint_fold(struct pcc_joint* j, uint64_t* bytes, uint64_t* pairs);
+const char* pcc_count_init(int measure);
+const char* pcc_count_variant(void);
+
+/* pcc_server.c */
+extern uint64_t pcc_restored[PCC_NCHARS];
+extern uint64_t pcc_restored_requests;
+extern struct pcc_shard *shards;
+extern struct pcc_xcounts *xshards;
+extern int num_shards;
+extern int listen_socket;
+extern volatile int stopping;
+void pcc_commit(struct pcc_shard* shard, struct pcc_conn* conn);
+
+/* pcc_control.c */
+extern const char* control_path;
+void pcc_shard_read(const struct pcc_shard* shard, struct pcc_shard* copy);
+void pcc_xshard_read(const struct pcc_shard* shard, const struct pcc_xcounts* x, struct pcc_xcounts* copy);
+void control_start(void);
+void control_stop(void);
+
+/* pcc_statsfile.c */
+extern int statsfile_sync_every;
+void pcc_statsfile_open(const char* path, uint64_t* counts, uint64_t* requests);
+void pcc_statsfile_add(const uint64_t* counts, uint64_t requests);
+void pcc_statsfile_close(void);
+
+/* pcc_timer.c */
+extern int client_timeout_ms;
+uint64_t pcc_ticks(void);
+void pcc_wheel_init(struct pcc_wheel* w);
+void pcc_timer_arm(struct pcc_wheel* w, struct pcc_timer* t);
+void pcc_timer_cancel(struct pcc_wheel* w, struct pcc_timer* t);
+void pcc_conn_deadline(struct pcc_wheel* w, struct pcc_conn* conn);
+void pcc_wheel_advance(struct pcc_wheel* w, uint64_t now, void (*expire)(struct pcc_timer* t, void* arg), void* arg);
+
+/* pcc_epoll.c */
+extern int stop_fd;
+extern int max_conns;
+extern int accept_batch;
+void* event_loop(void* shard);
+
+/* pcc_uring.c */
+void* uring_loop(void* shard);
+
+/* pcc_pipeline.c */
+extern int pipeline_counters;
+extern uint64_t pipeline_min;
+int pcc_pipeline_body(struct pcc_conn* conn);
+
+#endif
@@ -0,0 +1,383 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <poll.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "pcc.h"
+
+/*
+* Load generator for the servers in this directory:
+*   pcc_bench [-c connections] [-d seconds] [-r rate] [-s sizes] [-1] <server_ip> <server_port>
+* Every connection is a thread with one request in flight at a time, on a v2 connection (see pcc.h), or
+* with -1 on a new v1 connection per request (the connect is part of its latency).
+*   -c  concurrent connections (default 8)
+*   -d  how long to send requests, in seconds (default 10)
+*   -r  requests per second over all connections, sent on a fixed schedule; latency is measured from
+*       the time a request was due, so a server that falls behind can't hide it (coordinated omission).
+*       Without -r (closed loop) every connection sends its next request as soon as the last one was answered.
+*   -s  body sizes: N (all the same), MIN-MAX (uniform) or exp:MEAN (exponential, capped at 20 * MEAN),
+*       with an optional k/m/g suffix; default 64k
+* Bodies are random bytes taken at random offsets of one buffer. Every reply is checked against the count
+* computed here (pcc_count(), itself checked against the plain loop by pcc_count_test); the latencies go to
+* log-linear (HDR-style) histograms, about 1.5% precision from 1 ns to hours, one per connection.
+* Prints requests/s, body MB/s and latency percentiles; exits 1 if any count was wrong or a connection failed.
+*
+* gcc -O3 -Wall -std=gnu11 -pthread -o pcc_bench pcc_bench.c pcc_count.c -lm
+*/
+
+#define HDR_HALF 64 /* values per power of two, from 2 * HDR_HALF on */
+#define HDR_BUCKETS (2 * HDR_HALF + (64 - 7) * HDR_HALF)
+#define MAX_OFFSET 4096 /* bodies start anywhere in the first 4 KB of the buffer */
+#define HELLO_TIMEOUT_MS 1000 /* a v1 server never answers the hello, it waits for the body */
+
+struct hdr {
+    uint64_t count[HDR_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+enum size_kind { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP };
+
+struct sizes {
+    enum size_kind kind;
+    uint64_t a, b; /* fixed: a; uniform: a..b; exp: mean a, capped at b */
+};
+
+struct conn_worker {
+    pthread_t thread;
+    int id;
+    uint64_t rng;
+    uint64_t requests, bytes, wrong;
+    int failed;
+    struct hdr latency;
+};
+
+static struct sockaddr_in serv_addr;
+static int nconns = 8;
+static int v1;
+static double rate; /* 0: closed loop */
+static struct sizes sizes = {SIZE_FIXED, 65536, 65536};
+static unsigned char* pool; /* MAX_OFFSET + the biggest body */
+static uint64_t start_ns, end_ns;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns) {
+    struct timespec ts = {.tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL};
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* xorshift64*, one state per connection */
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/* values below 2 * HDR_HALF exactly, then HDR_HALF buckets per power of two */
+static int hdr_index(uint64_t v) {
+    int shift;
+    if(v < 2 * HDR_HALF)
+        return v;
+    shift = 63 - __builtin_clzll(v) - 6; /* v >> shift in [HDR_HALF, 2 * HDR_HALF) */
+    return 2 * HDR_HALF + (shift - 1) * HDR_HALF + (int)((v >> shift) - HDR_HALF);
+}
+
+/* the highest value that lands in bucket i */
+static uint64_t hdr_value(int i) {
+    int shift;
+    if(i < 2 * HDR_HALF)
+        return i;
+    shift = (i - 2 * HDR_HALF) / HDR_HALF + 1;
+    return ((uint64_t)((i - 2 * HDR_HALF) % HDR_HALF + HDR_HALF + 1) << shift) - 1;
+}
+
+static void hdr_record(struct hdr* h, uint64_t v) {
+    h->count[hdr_index(v)]++;
+    h->total++;
+    if(v > h->max)
+        h->max = v;
+}
+
+static void hdr_merge(struct hdr* into, const struct hdr* h) {
+    for(int i = 0; i < HDR_BUCKETS; i++)
+        into->count[i] += h->count[i];
+    into->total += h->total;
+    if(h->max > into->max)
+        into->max = h->max;
+}
+
+/* the value at quantile q (0..1) */
+static uint64_t hdr_percentile(const struct hdr* h, double q) {
+    uint64_t rank = (uint64_t)ceil(q * h->total), seen = 0;
+    if(rank == 0)
+        rank = 1;
+    for(int i = 0; i < HDR_BUCKETS; i++){
+        seen += h->count[i];
+        if(seen >= rank)
+            return hdr_value(i) < h->max ? hdr_value(i) : h->max;
+    }
+    return h->max;
+}
+
+/* "64k" and the like; exits on garbage */
+static uint64_t parse_size(const char* s, char** end) {
+    uint64_t v = strtoull(s, end, 10);
+    if(*end == s){
+        fprintf(stderr, "Error: bad size %s\n", s);
+        exit(1);
+    }
+    switch(**end){
+    case 'k': case 'K': v <<= 10; (*end)++; break;
+    case 'm': case 'M': v <<= 20; (*end)++; break;
+    case 'g': case 'G': v <<= 30; (*end)++; break;
+    }
+    return v;
+}
+
+static void parse_sizes(const char* s) {
+    char* end;
+    if(strncmp(s, "exp:", 4) == 0){
+        sizes.kind = SIZE_EXP;
+        sizes.a = parse_size(s + 4, &end);
+        sizes.b = 20 * sizes.a;
+    }
+    else{
+        sizes.a = sizes.b = parse_size(s, &end);
+        sizes.kind = SIZE_FIXED;
+        if(*end == '-'){
+            sizes.kind = SIZE_UNIFORM;
+            sizes.b = parse_size(end + 1, &end);
+        }
+    }
+    if(*end != '\0' || sizes.b < sizes.a){
+        fprintf(stderr, "Error: bad sizes %s\n", s);
+        exit(1);
+    }
+}
+
+static uint64_t draw_size(uint64_t* rng) {
+    double u;
+    uint64_t n;
+    switch(sizes.kind){
+    case SIZE_UNIFORM:
+        return sizes.a + next_random(rng) % (sizes.b - sizes.a + 1);
+    case SIZE_EXP:
+        u = (next_random(rng) >> 11) * 0x1.0p-53; /* [0, 1) */
+        n = (uint64_t)(-log(1 - u) * sizes.a);
+        return n < sizes.b ? n : sizes.b;
+    default:
+        return sizes.a;
+    }
+}
+
+/* a connection error fails this connection only, it is reported in the summary */
+static int send_all(int fd, const void* buf, size_t len) {
+    while(len > 0){
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            perror("Error: failed sending request: ");
+            return 1;
+        }
+        buf = (const char*)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void* buf, size_t len) {
+    while(len > 0){
+        ssize_t n = recv(fd, buf, len, 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0){
+            if(n < 0)
+                perror("Error: failed reading reply: ");
+            else
+                fprintf(stderr, "Error: server closed the connection\n");
+            return 1;
+        }
+        buf = (char*)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* a connected socket, v2 already negotiated unless -1; -1 on failure */
+static int open_conn(void) {
+    uint64_t hello = htobe64(PCC_HELLO), echo;
+    struct pollfd pfd = {.events = POLLIN};
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0){
+        perror("Error: failed connecting: ");
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)); /* the 8-byte header goes out at once */
+    if(v1)
+        return fd;
+    pfd.fd = fd;
+    if(send_all(fd, &hello, sizeof(hello)) != 0 || poll(&pfd, 1, HELLO_TIMEOUT_MS) != 1
+       || recv_all(fd, &echo, sizeof(echo)) != 0 || echo != hello){
+        fprintf(stderr, "Error: server doesn't speak v2, try -1\n");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void* conn_main(void* arg) {
+    struct conn_worker* w = arg;
+    uint64_t interval = rate > 0 ? (uint64_t)(1e9 * nconns / rate) : 0; /* this connection's share of the rate */
+    uint64_t due = start_ns + (rate > 0 ? interval * w->id / nconns : 0); /* connections take turns */
+    int fd = v1 ? -1 : open_conn();
+
+    if(!v1 && fd < 0){
+        w->failed = 1;
+        return NULL;
+    }
+    while(1){
+        uint64_t N = draw_size(&w->rng);
+        const unsigned char* body = pool + next_random(&w->rng) % MAX_OFFSET;
+        uint64_t expected = pcc_count(body, N, NULL);
+        uint64_t N_network = htobe64(N), C_network, t0;
+
+        if(rate > 0){
+            if(due >= end_ns)
+                break;
+            sleep_until(due);
+            t0 = due; /* late is the server's fault too */
+            due += interval;
+        }
+        else{
+            t0 = now_ns();
+            if(t0 >= end_ns)
+                break;
+        }
+        if(v1 && (fd = open_conn()) < 0){
+            w->failed = 1;
+            break;
+        }
+        if(send_all(fd, &N_network, sizeof(N_network)) != 0 || send_all(fd, body, N) != 0
+           || recv_all(fd, &C_network, sizeof(C_network)) != 0){
+            w->failed = 1;
+            break;
+        }
+        hdr_record(&w->latency, now_ns() - t0);
+        if(be64toh(C_network) != expected){
+            if(w->wrong++ == 0)
+                fprintf(stderr, "Error: %lu printable chars in a %lu-byte body, the server said %lu\n",
+                        expected, N, be64toh(C_network));
+        }
+        w->requests++;
+        w->bytes += N;
+        if(v1){
+            close(fd);
+            fd = -1;
+        }
+    }
+    if(fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    double seconds = 10, elapsed;
+    struct conn_worker* workers;
+    struct hdr* all;
+    uint64_t requests = 0, bytes = 0, wrong = 0;
+    int failed = 0;
+    int opt;
+
+    while((opt = getopt(argc, argv, "c:d:r:s:1")) != -1){
+        if(opt == 'c' && atoi(optarg) > 0)
+            nconns = atoi(optarg);
+        else if(opt == 'd' && atof(optarg) > 0)
+            seconds = atof(optarg);
+        else if(opt == 'r' && atof(optarg) > 0)
+            rate = atof(optarg);
+        else if(opt == 's')
+            parse_sizes(optarg);
+        else if(opt == '1')
+            v1 = 1;
+        else{
+            fprintf(stderr, "usage: %s [-c connections] [-d seconds] [-r rate] [-s N | MIN-MAX | exp:MEAN] [-1] <server_ip> <server_port>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if(argc - optind != 2){
+        fprintf(stderr, "Error: wrong number of arguments\n");
+        exit(1);
+    }
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(atoi(argv[optind + 1]));
+    if(inet_pton(AF_INET, argv[optind], &serv_addr.sin_addr) != 1){
+        fprintf(stderr, "Error: bad server address %s\n", argv[optind]);
+        exit(1);
+    }
+
+    pool = malloc(MAX_OFFSET + sizes.b);
+    workers = calloc(nconns, sizeof(struct conn_worker));
+    all = calloc(1, sizeof(struct hdr));
+    if(pool == NULL || workers == NULL || all == NULL){
+        perror("Error: malloc: ");
+        exit(1);
+    }
+    srandom(1);
+    for(uint64_t i = 0; i < MAX_OFFSET + sizes.b; i++)
+        pool[i] = random();
+
+    start_ns = now_ns();
+    end_ns = start_ns + (uint64_t)(seconds * 1e9);
+    for(int c = 0; c < nconns; c++){
+        workers[c].id = c;
+        workers[c].rng = 0x9E3779B97F4A7C15ULL * (c + 1);
+        if(pthread_create(&workers[c].thread, NULL, conn_main, &workers[c]) != 0){
+            perror("Error: failed creating thread: ");
+            exit(1);
+        }
+    }
+    for(int c = 0; c < nconns; c++){
+        pthread_join(workers[c].thread, NULL);
+        requests += workers[c].requests;
+        bytes += workers[c].bytes;
+        wrong += workers[c].wrong;
+        failed += workers[c].failed;
+        hdr_merge(all, &workers[c].latency);
+    }
+    elapsed = (now_ns() - start_ns) / 1e9;
+
+    printf("%lu requests in %.2f s over %d %s connections%s\n", requests, elapsed, nconns, v1 ? "v1" : "v2",
+           rate > 0 ? "" : " (closed loop)");
+    printf("%.1f requests/s, %.1f MB/s\n", requests / elapsed, bytes / elapsed / 1e6);
+    printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           hdr_percentile(all, 0.5) / 1e3, hdr_percentile(all, 0.9) / 1e3, hdr_percentile(all, 0.99) / 1e3,
+           hdr_percentile(all, 0.999) / 1e3, all->max / 1e3);
+    printf("%lu wrong counts, %d failed connections\n", wrong, failed);
+    free(pool);
+    free(workers);
+    free(all);
+    return (wrong == 0 && failed == 0) ? 0 : 1;
+}
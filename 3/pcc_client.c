@@ -1,6 +1,8 @@
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <string.h>
@@ -11,6 +13,40 @@
 #include <errno.h>
 #include <endian.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <pthread.h>
+#include "pcc.h"
+
+/*
+* pcc_client [-z | -d | -a] [-w window | -p connections] [-f] {<server_ip> <server_port> | <socket_path>} <file> [file ...]
+* An address with a '/' is the path of the server's UNIX socket (pcc_server -l), for clients on its host.
+* The file goes to the socket without passing through a user-space buffer: sendfile() by default,
+* or with -z the file mmap'd and sent with MSG_ZEROCOPY (the kernel pins the pages instead of copying
+* them, worth it for very large files on a real NIC; loopback still copies). Other kinds of files
+* (pipes, /dev/stdin) fall back to read()/write().
+* Several files (or -w) use one v2 connection for all of them (see pcc.h), with up to `window` requests
+* sent before waiting for the oldest reply (default 1). A server that doesn't answer the v2 hello
+* gets one v1 connection per file.
+* -p splits one file into that many byte ranges, each sent as its own v1 request on its own connection
+* by its own thread (sendfile/mmap at the range's offset); the counts are summed, so the result is the
+* same as one upload while a multi-threaded server counts the ranges on several cores.
+* -d (UNIX socket only) passes each open file to the server (SCM_RIGHTS) instead of its bytes: the
+* server reads the file itself and nothing goes through the socket but the header and the reply.
+* -a counts each file here, with the server's counting kernel, and sends only the counts (PCC_HIST:
+* C and the 95 counters, 776 bytes whatever the file's size); the server has to trust us (pcc_server -a).
+* -f opens TCP connections with Fast Open (pcc_server -q): connect() returns at once and the first write
+* goes out on the SYN once the server gave us a cookie, a round trip less per connection; without a cookie
+* (or net.ipv4.tcp_fastopen not allowing clients, bit 1) it is a plain handshake.
+* Build: gcc -O3 -Wall -std=gnu11 -pthread -o pcc_client pcc_client.c pcc_count.c
+*/
+
+#define COPY_BUFFER_SIZE 100000 /* buffer for the read()/write() fallback, 100KB < 1MB as required */
+#define ZC_MAX_PENDING 64 /* zerocopy sends in flight before waiting for the kernel to release some */
+#define HELLO_TIMEOUT_MS 1000 /* a v1 server never answers the hello, it waits for the body */
 
 
 void send_N(int socket_fd, void *buffer)
@@ -32,132 +68,503 @@ void send_N(int socket_fd, void *buffer)
     }
 }
 
+/* write all len bytes of buffer, however short the single writes are */
+void send_all(int socket_fd, const char *buffer, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t nsent = write(socket_fd, buffer, len);
+        if (nsent < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error: failed sending N bytes: ");
+            exit(1);
+        }
+        buffer += nsent;
+        len -= nsent;
+    }
+}
 
-int main(int argc, char *argv[]){
-    char* sever_ip_str; /* argv[1] - server's IP address in string */
-    uint16_t server_port; /* argv[2] - server's port number - 16-bit unsigned integer*/
-    char* file_path; /* argv[3] - path of the file to send */
-    FILE* file; /* file descriptor of the file to send */
-    int socket_fd;
-    struct sockaddr_in serv_addr; /* server's address - saw in TIRGUL*/
-    uint64_t N; /* number of bytes - file_size */
-    uint64_t N_network; /* number of bytes - file_size - network byte order */
-    uint64_t C; /* number of printable characters */
-    
-    int total_sent; /* total number of bytes sent so far */
-    int total_read; /* total number of bytes read so far */
-    int not_ridden;
-    int not_written; /* number of bytes not written yet */
-    int nsent; /* number of bytes sent in the last iteration */
-    int nread; /* number of bytes read in the last iteration */
-    char file_buffer[100000]; /* buffer for file 100KB < 1MB as required */
-    char* readc_buffer; /* buffer for C */
-    int bytes_readc; /* number of bytes read in the last iteration in C*/
-
-
-    if (argc != 4) { /* argc has to be 4 (3 real arguments) */
-        printf("Error: wrong number of arguments \n");
-        exit(1);
+/*
+* fallback for files sendfile() can't read: copy N bytes from offset start through a buffer (pipes only have start 0).
+* returns the bytes sent (the file may end early)
+*/
+uint64_t send_copy(int socket_fd, int file_fd, uint64_t start, uint64_t N)
+{
+    char file_buffer[COPY_BUFFER_SIZE];
+    uint64_t total_sent = 0;
+    while(total_sent < N)
+    {
+        size_t want = N - total_sent < sizeof(file_buffer) ? N - total_sent : sizeof(file_buffer);
+        ssize_t nread = start == 0 ? read(file_fd, file_buffer, want) : pread(file_fd, file_buffer, want, start + total_sent);
+        if (nread < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error: failed reading file: ");
+            exit(1);
+        }
+        if (nread == 0)
+            break;
+        send_all(socket_fd, file_buffer, nread);
+        total_sent += nread;
     }
-    sever_ip_str = argv[1];
-    server_port = atoi(argv[2]); 
-    file_path = argv[3];
-    /* open the file */
-    file = fopen(file_path, "r"); /* open the file in read-only mode */
-    if (file == NULL) {
-        perror("Error: failed openning file: ");
-        exit(1);
+    return total_sent;
+}
+
+/* send N bytes of the file from offset start straight from the page cache. returns the bytes sent */
+uint64_t send_file(int socket_fd, int file_fd, uint64_t start, uint64_t N)
+{
+    off_t offset = start; /* the file's own offset is not used, ranges can be sent concurrently */
+    while((uint64_t)offset - start < N)
+    {
+        ssize_t nsent = sendfile(socket_fd, file_fd, &offset, N - (offset - start)); /* advances offset, short sends included */
+        if (nsent < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EINVAL || errno == ENOSYS) && (uint64_t)offset == start) /* not a file sendfile() can read */
+                return send_copy(socket_fd, file_fd, start, N);
+            perror("Error: failed sending N bytes: ");
+            exit(1);
+        }
+        if (nsent == 0) /* file shrank */
+            break;
+    }
+    return offset - start;
+}
+
+/*
+* read zerocopy completions off the socket's error queue; with wait, block until at least one came.
+* returns how many sends the kernel is done with (their pages may be reused)
+*/
+uint32_t zc_reap(int socket_fd, int wait)
+{
+    char control[128];
+    uint32_t done = 0;
+    struct pollfd pfd = {.fd = socket_fd, .events = 0}; /* POLLERR is always reported */
+
+    while(1)
+    {
+        struct msghdr msg = {.msg_control = control, .msg_controllen = sizeof(control)};
+        if (recvmsg(socket_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Error: failed reading zerocopy completions: ");
+                exit(1);
+            }
+            if (done > 0 || !wait)
+                return done;
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                perror("Error: failed waiting for zerocopy completions: ");
+                exit(1);
+            }
+            continue;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno == 0 && serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+                done += serr->ee_data - serr->ee_info + 1; /* sends ee_info..ee_data completed */
+        }
     }
-    /* create a socket */
-    socket_fd = socket(AF_INET, SOCK_STREAM, 0); /* create a TCP socket: AF_INET(IPV4), SOCK_STREAM(TCP) */
+}
+
+/* -z: mmap N bytes of the file from offset start and send them with MSG_ZEROCOPY, unmapping only once the kernel released every page */
+uint64_t send_zerocopy(int socket_fd, int file_fd, uint64_t start, uint64_t N)
+{
+    char *map, *data;
+    uint64_t total_sent = 0;
+    uint32_t pending = 0; /* sends whose pages the kernel may still read */
+    int zc_flag = MSG_ZEROCOPY;
+    uint64_t skip = start % sysconf(_SC_PAGESIZE); /* mappings start on a page */
+
+    if (N == 0)
+        return 0;
+    map = mmap(NULL, N + skip, PROT_READ, MAP_SHARED, file_fd, start - skip);
+    if (map == MAP_FAILED) /* not mappable (pipe, ...) */
+        return send_file(socket_fd, file_fd, start, N);
+    data = map + skip;
+    madvise(map, N + skip, MADV_SEQUENTIAL);
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_ZEROCOPY, &(int){1}, sizeof(int)) < 0)
+        zc_flag = 0; /* kernel without zerocopy: still no read() copy, send() copies from the mapping */
+
+    while(total_sent < N)
+    {
+        ssize_t nsent = send(socket_fd, data + total_sent, N - total_sent, zc_flag);
+        if (nsent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOBUFS && pending > 0) { /* too many pinned pages, wait for the kernel to release some */
+                pending -= zc_reap(socket_fd, 1);
+                continue;
+            }
+            perror("Error: failed sending N bytes: ");
+            exit(1);
+        }
+        total_sent += nsent;
+        if (zc_flag != 0) {
+            pending++;
+            pending -= zc_reap(socket_fd, pending >= ZC_MAX_PENDING);
+        }
+    }
+    while(pending > 0)
+        pending -= zc_reap(socket_fd, 1);
+    munmap(map, N + skip);
+    return total_sent;
+}
+
+
+/* the server's address: TCP, or a UNIX socket on this host */
+union server_addr {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_un un;
+};
+
+int fastopen = 0; /* -f */
+
+/* connect a new socket to the server */
+int connect_server(union server_addr *serv_addr)
+{
+    int socket_fd = socket(serv_addr->sa.sa_family, SOCK_STREAM, 0); /* create a TCP socket: AF_INET(IPV4), SOCK_STREAM(TCP), or AF_UNIX */
     if (socket_fd < 0) {
         perror("Error: failed creating socket: ");
         exit(1);
     }
-    /* set the server's address */
-    memset(&serv_addr, 0, sizeof(serv_addr)); /* first clean the struct */
-    serv_addr.sin_family = AF_INET; /* IPV4 */
-    serv_addr.sin_port = htons(server_port); /* 16bit server's port number + adjusting endiannes */
-    if (inet_pton(AF_INET, sever_ip_str, &(serv_addr.sin_addr.s_addr)) != 1){ /* server's IP address */
-        perror("Error: failed converting IP address: ");
+    if (fastopen && serv_addr->sa.sa_family == AF_INET &&
+        setsockopt(socket_fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &(int){1}, sizeof(int)) < 0) {
+        perror("Error: failed to set socket option TCP_FASTOPEN_CONNECT: ");
         exit(1);
     }
     /* connect to the server */
-    if (connect(socket_fd,(struct sockaddr*) &serv_addr, sizeof(serv_addr)) < 0) 
+    if (connect(socket_fd, &serv_addr->sa, serv_addr->sa.sa_family == AF_UNIX ? sizeof(serv_addr->un) : sizeof(serv_addr->in)) < 0) 
     {
         perror("Error: failed connecting to server: ");
         exit(1);
     }
-    /* send file to the server according to protocol */
-    /* a. send N - file_size in 64-bit unsigned integer in network byte order */
-    
-    /* get the file size, origin: https://www.geeksforgeeks.org/c-program-find-size-file/ */
-    fseek(file, 0L, SEEK_END);
-    N = ftell(file); /* N is length of file in bytes */
-    N_network = htobe64(N); /* convert to big endian==network byte order */
-    fseek(file, 0L, SEEK_SET); /* set the file to the start - "reset file" */
+    return socket_fd;
+}
 
-    /* send N in network byte order as seen in TIRGUL */    
+/* open a file to send, returns its fd and its size in N */
+int open_file(const char *file_path, uint64_t *N)
+{
+    struct stat file_stat;
+    /* open the file */
+    int file_fd = open(file_path, O_RDONLY); /* open the file in read-only mode */
+    if (file_fd < 0) {
+        perror("Error: failed openning file: ");
+        exit(1);
+    }
+    if (fstat(file_fd, &file_stat) < 0) {
+        perror("Error: failed reading file size: ");
+        exit(1);
+    }
+    *N = file_stat.st_size; /* N is length of file in bytes */
+    return file_fd;
+}
+
+/* send one request according to protocol: N, then the N bytes of the file from offset start */
+void send_range(int socket_fd, int file_fd, uint64_t start, uint64_t N, int zerocopy)
+{
+    uint64_t N_network = htobe64(N); /* number of bytes - network byte order */
+    uint64_t total_sent; /* total number of bytes sent */
+
+    /* a. send N in 64-bit unsigned integer in network byte order, as seen in TIRGUL */
     send_N(socket_fd, &N_network);
     /* b. send the server N bytes (the file’s content) */
-    /* read the file and send it to the server */
+    total_sent = zerocopy ? send_zerocopy(socket_fd, file_fd, start, N) : send_file(socket_fd, file_fd, start, N);
+    if (total_sent != N) { /* the server waits for exactly N bytes */
+        fprintf(stderr, "Error: file changed while sending it\n");
+        exit(1);
+    }
+}
 
-    total_sent = 0;
-    not_written = N; /* we have to send N bytes */
-    /* keep looping until nothing left to write */
-    while(not_written > 0)
-    {
-        /* read from file[total_sent] to file_buffer at most 1 byte */
-        nread = fread(file_buffer, 1, 100000,file); /* reads from file to file_buffer 100000 elements of 1 byte */
-        if (nread < 0) {
-            perror("Error: failed reading file: ");
-            exit(1);
-        }
+/* -d: a request without a body, N is PCC_FD and the open file goes along with it */
+void send_fd(int socket_fd, int file_fd)
+{
+    uint64_t N_network = htobe64(PCC_FD);
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {.iov_base = &N_network, .iov_len = sizeof(N_network)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr *cm;
+    ssize_t nsent;
 
-        /* write to socket from file_buffer at most not_written bytes */
-        nsent = write(socket_fd, file_buffer, nread); 
-        if (nsent < 0) {
-            perror("Error: failed sending N bytes: ");
-            exit(1);
+    memset(control, 0, sizeof(control));
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &file_fd, sizeof(int));
+    do {
+        nsent = sendmsg(socket_fd, &msg, 0);
+    } while (nsent < 0 && errno == EINTR);
+    if (nsent < 0) {
+        perror("Error: failed passing file: ");
+        exit(1);
+    }
+    send_all(socket_fd, (char *)&N_network + nsent, sizeof(N_network) - nsent); /* the file went with the first byte */
+}
+
+/* -a: count the N bytes of the file here and send a request with only the counts */
+void send_hist(int socket_fd, int file_fd, uint64_t N)
+{
+    uint64_t hist[PCC_NCHARS] = {0};
+    uint64_t request[PCC_NCHARS + 2]; /* PCC_HIST, C, the counters */
+    uint64_t C = 0;
+    char *map = N > 0 ? mmap(NULL, N, PROT_READ, MAP_SHARED, file_fd, 0) : MAP_FAILED;
+
+    if (map != MAP_FAILED) {
+        madvise(map, N, MADV_SEQUENTIAL);
+        C = pcc_count((const unsigned char *)map, N, hist);
+        munmap(map, N);
+    }
+    else { /* not mappable (pipe, ...): through a buffer to its end */
+        char file_buffer[COPY_BUFFER_SIZE];
+        ssize_t nread;
+        while ((nread = read(file_fd, file_buffer, sizeof(file_buffer))) != 0) {
+            if (nread < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("Error: failed reading file: ");
+                exit(1);
+            }
+            C += pcc_count((const unsigned char *)file_buffer, nread, hist);
         }
-        total_sent  += nsent;
-        not_written -= nsent;
-        /* reset the file_buffer */
-        memset(file_buffer, 0, sizeof(file_buffer)); 
     }
+    request[0] = htobe64(PCC_HIST);
+    request[1] = htobe64(C);
+    for (int i = 0; i < PCC_NCHARS; i++)
+        request[i + 2] = htobe64(hist[i]);
+    send_all(socket_fd, (const char *)request, sizeof(request));
+}
 
+/* send a whole file as one request, only pass it with -d or only its counts with -a */
+void send_request(int socket_fd, const char *file_path, int zerocopy, int pass_fd, int local_count)
+{
+    uint64_t N;
+    int file_fd = open_file(file_path, &N);
+    if (pass_fd)
+        send_fd(socket_fd, file_fd); /* the server holds its own reference now */
+    else if (local_count)
+        send_hist(socket_fd, file_fd, N);
+    else
+        send_range(socket_fd, file_fd, 0, N, zerocopy);
     /* close file, no need of file anymore */
-    fclose(file);
-
+    close(file_fd);
+}
 
-    /* as seen in TIRGUL */
-    /* c. read C- number of printable characters- 64-bit unsigned integer in network byte order from server */
-    /* allocate memory for readc_buffer */
-    readc_buffer = (char*)malloc(sizeof(uint64_t));
-    if (readc_buffer == NULL) {
-        perror("Error: failed allocating memory for readc_buffer: ");
-        exit(1);
-    }
-     /* reset the buffer */
-    memset(readc_buffer, 0, sizeof(uint64_t)); /* reset the buffer */
-    total_read = 0;
-    not_ridden = 8; /* we have to read 8 bytes */
+/* c. read C- number of printable characters- 64-bit unsigned integer in network byte order from server */
+uint64_t read_C(int socket_fd)
+{
+    uint64_t C_network;
+    int total_read = 0;
+    int not_ridden = sizeof(C_network); /* we have to read 8 bytes */
     while(not_ridden > 0) /* while is there anything to read */
     {
-        bytes_readc = read(socket_fd, readc_buffer + total_read, not_ridden);  
+        int bytes_readc = read(socket_fd, (char*)&C_network + total_read, not_ridden);
         if(bytes_readc < 0)
         {
+            if (errno == EINTR)
+                continue;
             perror("Error: failed reading C: ");
             exit(1);
         }
+        if(bytes_readc == 0)
+        {
+            fprintf(stderr, "Error: server closed the connection\n");
+            exit(1);
+        }
         total_read += bytes_readc;
         not_ridden -= bytes_readc;
     } 
-    /* convert to host byte order */
-    C = be64toh(*(uint64_t*)readc_buffer);
-    /* print the number of printable characters */
-    printf("# of printable characters: %lu\n", C);
+    return be64toh(C_network); /* convert to host byte order */
+}
+
+/* ask for a v2 connection. returns 1 if the server agreed, 0 if it is a v1 server (the socket is then useless) */
+int hello(int socket_fd)
+{
+    uint64_t hello_network = htobe64(PCC_HELLO);
+    struct pollfd pfd = {.fd = socket_fd, .events = POLLIN};
+    int ready;
+
+    send_N(socket_fd, &hello_network);
+    do {
+        ready = poll(&pfd, 1, HELLO_TIMEOUT_MS);
+    } while (ready < 0 && errno == EINTR);
+    if (ready < 0) {
+        perror("Error: failed waiting for the server: ");
+        exit(1);
+    }
+    return ready > 0 && read_C(socket_fd) == PCC_HELLO;
+}
+
+/* -p: one byte range of the file, sent on its own connection */
+struct range {
+    pthread_t thread;
+    union server_addr *serv_addr;
+    int file_fd;
+    uint64_t start, N;
+    int zerocopy;
+    uint64_t C; /* the server's count for the range */
+};
+
+void* send_range_thread(void *arg)
+{
+    struct range *r = arg;
+    int socket_fd = connect_server(r->serv_addr);
+    send_range(socket_fd, r->file_fd, r->start, r->N, r->zerocopy);
+    r->C = read_C(socket_fd);
     close(socket_fd);
-    exit(0);
+    return NULL;
+}
 
-}
\ No newline at end of file
+/* -p: split the file into nconns ranges of whole pages, upload them in parallel and add up their counts */
+uint64_t send_parallel(union server_addr *serv_addr, const char *file_path, int nconns, int zerocopy)
+{
+    uint64_t N, part, C = 0;
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    int file_fd = open_file(file_path, &N);
+    struct range *ranges = calloc(nconns, sizeof(struct range));
+
+    if (ranges == NULL) {
+        perror("Error: failed allocating ranges: ");
+        exit(1);
+    }
+    part = (N / nconns + page - 1) / page * page;
+    for (int i = 0; i < nconns; i++) {
+        ranges[i].serv_addr = serv_addr;
+        ranges[i].file_fd = file_fd;
+        ranges[i].start = i * part < N ? i * part : N;
+        ranges[i].N = (i + 1 == nconns || (i + 1) * part > N ? N : (i + 1) * part) - ranges[i].start;
+        ranges[i].zerocopy = zerocopy;
+        if (pthread_create(&ranges[i].thread, NULL, send_range_thread, &ranges[i]) != 0) {
+            perror("Error: failed creating thread: ");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < nconns; i++) {
+        pthread_join(ranges[i].thread, NULL);
+        C += ranges[i].C;
+    }
+    free(ranges);
+    close(file_fd);
+    return C;
+}
+
+int main(int argc, char *argv[]){
+    char* sever_ip_str; /* argv[1] - server's IP address in string */
+    uint16_t server_port; /* argv[2] - server's port number - 16-bit unsigned integer*/
+    char** file_paths; /* argv[3...] - paths of the files to send */
+    int nfiles;
+    int socket_fd;
+    union server_addr serv_addr; /* server's address - saw in TIRGUL*/
+    int naddr; /* arguments taken by the address: 2, or 1 for a UNIX socket */
+    int pass_fd = 0; /* -d */
+    int local_count = 0; /* -a */
+    uint64_t C; /* number of printable characters */
+    int zerocopy = 0; /* -z */
+    int window = 0; /* -w, 0 when not given */
+    int nconns = 0; /* -p, 0 when not given */
+    int nsent, nread; /* requests sent, replies read */
+    int opt;
+
+    while ((opt = getopt(argc, argv, "zdaw:p:f")) != -1) {
+        if (opt == 'z') {
+            zerocopy = 1;
+        }
+        else if (opt == 'd') {
+            pass_fd = 1;
+        }
+        else if (opt == 'a') {
+            local_count = 1;
+        }
+        else if (opt == 'w' && atoi(optarg) > 0) {
+            window = atoi(optarg);
+        }
+        else if (opt == 'p' && atoi(optarg) > 0) {
+            nconns = atoi(optarg);
+        }
+        else if (opt == 'f') {
+            fastopen = 1;
+        }
+        else {
+            printf("Error: usage: %s [-z | -d | -a] [-w window | -p connections] [-f] {<server_ip> <server_port> | <socket_path>} <file> [file ...]\n", argv[0]);
+            exit(1);
+        }
+    }
+    naddr = (optind < argc && strchr(argv[optind], '/') != NULL) ? 1 : 2;
+    if (argc - optind < naddr + 1 || (nconns > 0 && (argc - optind != naddr + 1 || window > 0))) { /* the address and files, -p takes one file */
+        printf("Error: wrong number of arguments \n");
+        exit(1);
+    }
+    if (pass_fd && (naddr != 1 || zerocopy || nconns > 0)) {
+        printf("Error: -d needs a UNIX socket and can't be used with -z or -p\n");
+        exit(1);
+    }
+    if (local_count && (pass_fd || zerocopy || nconns > 0)) {
+        printf("Error: -a can't be used with -d, -z or -p\n");
+        exit(1);
+    }
+    file_paths = &argv[optind + naddr];
+    nfiles = argc - optind - naddr;
+    /* set the server's address */
+    memset(&serv_addr, 0, sizeof(serv_addr)); /* first clean the struct */
+    if (naddr == 1) {
+        if (strlen(argv[optind]) >= sizeof(serv_addr.un.sun_path)) {
+            printf("Error: UNIX socket path too long\n");
+            exit(1);
+        }
+        serv_addr.un.sun_family = AF_UNIX;
+        strcpy(serv_addr.un.sun_path, argv[optind]);
+    }
+    else {
+        sever_ip_str = argv[optind];
+        server_port = atoi(argv[optind + 1]);
+        serv_addr.in.sin_family = AF_INET; /* IPV4 */
+        serv_addr.in.sin_port = htons(server_port); /* 16bit server's port number + adjusting endiannes */
+        if (inet_pton(AF_INET, sever_ip_str, &(serv_addr.in.sin_addr.s_addr)) != 1){ /* server's IP address */
+            perror("Error: failed converting IP address: ");
+            exit(1);
+        }
+    }
+
+    if (nconns > 0) { /* one file over nconns v1 connections */
+        C = send_parallel(&serv_addr, file_paths[0], nconns, zerocopy);
+        printf("# of printable characters: %lu\n", C);
+        exit(0);
+    }
+
+    if (nfiles == 1 && window == 0) { /* one file, one v1 connection */
+        socket_fd = connect_server(&serv_addr);
+        send_request(socket_fd, file_paths[0], zerocopy, pass_fd, local_count);
+        C = read_C(socket_fd);
+        /* print the number of printable characters */
+        printf("# of printable characters: %lu\n", C);
+        close(socket_fd);
+        exit(0);
+    }
+
+    if (window == 0)
+        window = 1;
+    socket_fd = connect_server(&serv_addr);
+    if (!hello(socket_fd)) { /* v1 server: a connection per file */
+        close(socket_fd);
+        for (int i = 0; i < nfiles; i++) {
+            socket_fd = connect_server(&serv_addr);
+            send_request(socket_fd, file_paths[i], zerocopy, pass_fd, local_count);
+            C = read_C(socket_fd);
+            printf("%s: # of printable characters: %lu\n", file_paths[i], C);
+            close(socket_fd);
+        }
+        exit(0);
+    }
+    /* v2: keep up to window requests in flight, the replies come back in order */
+    nsent = nread = 0;
+    while (nread < nfiles) {
+        while (nsent < nfiles && nsent - nread < window)
+            send_request(socket_fd, file_paths[nsent++], zerocopy, pass_fd, local_count);
+        C = read_C(socket_fd);
+        printf("%s: # of printable characters: %lu\n", file_paths[nread++], C);
+    }
+    close(socket_fd); /* between two requests: the server is done with us too */
+    exit(0);
+}
@@ -0,0 +1,366 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include "pcc.h"
+
+/* protocol engine: parses and counts whatever bytes a server loop received, see struct pcc_conn */
+
+#define FILE_BUFFER_SIZE 1048576 /* Allocations of up to 1 MB are OK. */
+
+int pcc_accept_hist = 0; /* -a: clients may send their own counts (PCC_HIST) */
+int pcc_analytics = 0; /* -x: also every byte value and printable pair (struct pcc_xconn) */
+static __thread struct pcc_xconn* spare_x; /* a cleared one the thread's last connection left, ~220 KB */
+
+
+/* TCP errors, a client that went away or missed its deadline (EAGAIN on a blocking socket) only fail this connection, anything else is fatal */
+int is_client_error(int err) {
+    return (err == ETIMEDOUT) || (err == ECONNRESET) || (err == EPIPE) || (err == EAGAIN) || (err == EWOULDBLOCK);
+}
+
+/* queue 8 bytes in network byte order to be sent */
+static void conn_queue(struct pcc_conn* conn, uint64_t value) {
+    uint64_t value_network = htobe64(value);
+    memcpy(conn->out + conn->out_len, &value_network, sizeof(value_network));
+    conn->out_len += sizeof(value_network);
+    conn->queued++;
+}
+
+/* -x: fold the request's joint table into unsent, with its printable chars into hist and printable */
+static void conn_fold(struct pcc_conn* conn) {
+    struct pcc_xconn* x = conn->x;
+    uint64_t bytes[256] = {0};
+
+    if(x->joint.counted > 0)
+        pcc_joint_fold(&x->joint, bytes, x->unsent.pairs);
+    if(x->big != NULL){ /* the part of a big request folded already */
+        for(int b = 0; b < 256; b++)
+            bytes[b] += x->big->bytes[b];
+        for(int i = 0; i < PCC_NCHARS * PCC_NCHARS; i++)
+            x->unsent.pairs[i] += x->big->pairs[i];
+        free(x->big);
+        x->big = NULL;
+    }
+    for(int b = 0; b < 256; b++){
+        x->unsent.bytes[b] += bytes[b];
+        if(32 <= b && b <= 126){
+            conn->hist[b-32] += bytes[b];
+            conn->printable += bytes[b];
+        }
+    }
+    x->joint.prev = PCC_NCHARS;
+}
+
+/* count len bytes of a body: the printable chars, with -x everything into the joint table (C comes with the fold) */
+static uint64_t conn_count(struct pcc_conn* conn, const unsigned char* buf, size_t len) {
+    struct pcc_xconn* x = conn->x;
+
+    if(!pcc_analytics)
+        return pcc_count(buf, len, conn->hist);
+    if(x == NULL){
+        x = spare_x != NULL ? spare_x : aligned_alloc(64, sizeof(struct pcc_xconn));
+        if(x == NULL){
+            perror("Error: failed allocating analytics: ");
+            exit(1);
+        }
+        if(x != spare_x)
+            memset(x, 0, sizeof(struct pcc_xconn));
+        spare_x = NULL;
+        x->joint.prev = PCC_NCHARS;
+        conn->x = x;
+    }
+    while(len > 0){
+        size_t n = len < PCC_JOINT_MAX - x->joint.counted ? len : PCC_JOINT_MAX - x->joint.counted;
+        pcc_count_joint(&x->joint, buf, n);
+        if(x->joint.counted == PCC_JOINT_MAX){ /* before a 32-bit counter could wrap */
+            if(x->big == NULL && (x->big = calloc(1, sizeof(struct pcc_xcounts))) == NULL){
+                perror("Error: failed allocating analytics: ");
+                exit(1);
+            }
+            pcc_joint_fold(&x->joint, x->big->bytes, x->big->pairs);
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* the whole body was seen: queue C, its counts wait in unsent until it was sent */
+static void conn_reply(struct pcc_conn* conn) {
+    if(conn->x != NULL)
+        conn_fold(conn);
+    conn_queue(conn, conn->printable);
+    for(int i = 0; i < PCC_NCHARS; i++)
+        conn->unsent[i] += conn->hist[i];
+    conn->unsent_requests++;
+    memset(conn->hist, 0, sizeof(conn->hist));
+    conn->printable = 0;
+    conn->have = 0;
+    /* v1 is done, v2 goes on with the next request while there is room for its reply */
+    conn->state = (conn->v2 && conn->out_len < sizeof(conn->out)) ? PCC_HEADER : PCC_REPLY;
+}
+
+/* start a new connection on fd: expecting the header, nothing counted */
+void pcc_conn_reset(struct pcc_conn* conn, int fd) {
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = fd;
+    conn->state = PCC_HEADER;
+}
+
+/* the connection is gone: drop what it still held */
+void pcc_conn_free(struct pcc_conn* conn) {
+    free(conn->stash);
+    conn->stash = NULL;
+    for(unsigned i = 0; i < conn->nfds; i++)
+        close(conn->fds[i]);
+    free(conn->fds);
+    conn->fds = NULL;
+    conn->nfds = 0;
+    if(conn->x != NULL){ /* what it didn't commit is dropped, the tables are kept for the thread's next connection */
+        free(conn->x->big);
+        if(spare_x == NULL){
+            memset(conn->x, 0, sizeof(struct pcc_xconn));
+            spare_x = conn->x;
+        }
+        else
+            free(conn->x);
+        conn->x = NULL;
+    }
+}
+
+/* the loop received a file passed by the client, for a PCC_FD request it has fed or will feed */
+void pcc_conn_pass_fd(struct pcc_conn* conn, int fd) {
+    int* fds = realloc(conn->fds, sizeof(int) * (conn->nfds + 1));
+    if(fds == NULL){
+        perror("Error: failed keeping passed file: ");
+        exit(1);
+    }
+    fds[conn->nfds++] = fd;
+    conn->fds = fds;
+}
+
+/*
+* PCC_FD: count the oldest passed file, read here to its end instead of arriving as a body.
+* returns 1 if it isn't a regular file or reading it failed (the connection fails, nothing is answered), 0 otherwise
+*/
+static int conn_count_file(struct pcc_conn* conn) {
+    int fd = conn->fds[0];
+    char* buf = malloc(FILE_BUFFER_SIZE);
+    struct stat st;
+    ssize_t n;
+    int failed = 0;
+
+    conn->nfds--;
+    memmove(conn->fds, conn->fds + 1, sizeof(int) * conn->nfds);
+    if(buf == NULL){
+        perror("Error: failed allocating file buffer: ");
+        exit(1);
+    }
+    if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)){
+        fprintf(stderr, "Error: client passed something that is not a regular file\n");
+        failed = 1;
+    }
+    while(!failed && (n = read(fd, buf, FILE_BUFFER_SIZE)) != 0){
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            perror("Error: failed reading passed file: ");
+            failed = 1;
+            break;
+        }
+        conn->printable += conn_count(conn, (const unsigned char*)buf, n);
+    }
+    free(buf);
+    close(fd);
+    return failed;
+}
+
+/* how many bytes the connection can take right now without reading past the request (0 while replying) */
+size_t pcc_conn_want(const struct pcc_conn* conn) {
+    if(conn->state == PCC_REPLY || conn->failed)
+        return 0;
+    if(conn->v2) /* requests follow each other, read whatever is there */
+        return SIZE_MAX;
+    if(conn->state == PCC_HEADER)
+        return sizeof(conn->hdr) - conn->have;
+    if(conn->state == PCC_COUNTS)
+        return (PCC_NCHARS + 1 - conn->words) * sizeof(conn->hdr) - conn->have;
+    return conn->remaining > SIZE_MAX ? SIZE_MAX : conn->remaining;
+}
+
+/*
+* feed received bytes to the connection: completes headers, counts bodies and queues the replies.
+* returns how many bytes of buf were used; it stops early in PCC_REPLY: in v1 anything after the
+* request is not part of it, in v2 the rest has to wait until out[] was sent.
+*/
+size_t pcc_conn_input(struct pcc_conn* conn, const char* buf, size_t len) {
+    size_t used = 0;
+    uint64_t N_network;
+
+    while(used < len && conn->state != PCC_REPLY && !conn->failed){
+        if(conn->state == PCC_COUNTS){ /* one more 8-byte counter */
+            size_t n = sizeof(conn->hdr) - conn->have;
+            if(n > len - used)
+                n = len - used;
+            memcpy(conn->hdr + conn->have, buf + used, n);
+            conn->have += n;
+            used += n;
+            if(conn->have < sizeof(conn->hdr))
+                return used;
+            conn->have = 0;
+            memcpy(&N_network, conn->hdr, sizeof(N_network));
+            if(conn->words == 0) /* the client's C, kept in remaining until the counters are checked against it */
+                conn->remaining = be64toh(N_network);
+            else{
+                conn->hist[conn->words - 1] = be64toh(N_network);
+                conn->printable += conn->hist[conn->words - 1];
+            }
+            if(++conn->words < PCC_NCHARS + 1)
+                continue;
+            if(conn->printable != conn->remaining){
+                fprintf(stderr, "Error: client histogram doesn't add up\n");
+                conn->failed = 1;
+                return used;
+            }
+            conn_reply(conn);
+            continue;
+        }
+        if(conn->state == PCC_HEADER){
+            size_t n = sizeof(conn->hdr) - conn->have;
+            if(n > len - used)
+                n = len - used;
+            memcpy(conn->hdr + conn->have, buf + used, n);
+            conn->have += n;
+            used += n;
+            if(conn->have < sizeof(conn->hdr))
+                return used;
+            memcpy(&N_network, conn->hdr, sizeof(N_network));
+            conn->remaining = be64toh(N_network); /* N is 8 bytes and adjust endians */
+            if(!conn->v2 && conn->remaining == PCC_HELLO){ /* switch to v2, acknowledged by the same magic */
+                conn->v2 = 1;
+                conn->have = 0;
+                conn_queue(conn, PCC_HELLO);
+                continue;
+            }
+            if(conn->remaining == PCC_FD && conn->nfds > 0){ /* no body, the file came along */
+                if(conn_count_file(conn)){
+                    conn->failed = 1;
+                    return used;
+                }
+                conn_reply(conn);
+                continue;
+            }
+            if(conn->remaining == PCC_HIST){ /* no body, the client counted it */
+                if(!pcc_accept_hist){
+                    fprintf(stderr, "Error: client sent a histogram, the server doesn't take them (-a)\n");
+                    conn->failed = 1;
+                    return used;
+                }
+                conn->state = PCC_COUNTS;
+                conn->have = 0;
+                conn->words = 0;
+                continue;
+            }
+            conn->state = PCC_BODY;
+            if(conn->remaining == 0){ /* empty body: done with its header */
+                conn_reply(conn);
+                continue;
+            }
+        }
+        size_t n = len - used;
+        if(n > conn->remaining)
+            n = conn->remaining;
+        conn->printable += conn_count(conn, (const unsigned char*)buf + used, n);
+        conn->remaining -= n;
+        used += n;
+        if(conn->remaining == 0) /* whole body seen: C is ready */
+            conn_reply(conn);
+    }
+    return used;
+}
+
+/* input for the connection: what pcc_conn_input() can't take now is kept for later in v2 */
+void pcc_conn_feed(struct pcc_conn* conn, const char* buf, size_t len) {
+    size_t used;
+    char* stash;
+
+    conn->received += len;
+    used = pcc_conn_input(conn, buf, len);
+
+    if(used == len || !conn->v2 || conn->failed)
+        return;
+    stash = realloc(conn->stash, conn->stash_len + len - used);
+    if(stash == NULL){
+        perror("Error: failed keeping client input: ");
+        exit(1);
+    }
+    memcpy(stash + conn->stash_len, buf + used, len - used);
+    conn->stash = stash;
+    conn->stash_len += len - used;
+}
+
+/* v2 client closed its side with nothing left to feed: fine between requests only */
+static int conn_finish(struct pcc_conn* conn) {
+    if(conn->state == PCC_BODY || conn->state == PCC_COUNTS || conn->have != 0){
+        fprintf(stderr, "Error: client closed the connection early\n");
+        return -1;
+    }
+    return conn->out_len == 0 ? 1 : 0;
+}
+
+/*
+* everything in out[] was sent (and its counts committed by the loop): take input again, starting with
+* the stash. returns 1 if the connection is done, -1 if it failed, 0 if it goes on (out[] may have new replies)
+*/
+int pcc_conn_sent(struct pcc_conn* conn) {
+    conn->out_len = 0;
+    conn->out_off = 0;
+    if(!conn->v2)
+        return 1;
+    if(conn->state == PCC_REPLY)
+        conn->state = PCC_HEADER;
+    if(conn->stash != NULL){
+        conn->stash_off += pcc_conn_input(conn, conn->stash + conn->stash_off, conn->stash_len - conn->stash_off);
+        if(conn->stash_off == conn->stash_len){
+            free(conn->stash);
+            conn->stash = NULL;
+            conn->stash_len = conn->stash_off = 0;
+        }
+        if(conn->failed)
+            return -1;
+    }
+    if(conn->eof && conn->stash == NULL)
+        return conn_finish(conn);
+    return 0;
+}
+
+/*
+* the client closed its side. returns -1 if that failed the connection, 1 if it is done,
+* 0 if it is done once out[] was sent
+*/
+int pcc_conn_eof(struct pcc_conn* conn) {
+    if(!conn->v2){
+        if(conn->state != PCC_REPLY){ /* client closed the connection before sending everything */
+            fprintf(stderr, "Error: client closed the connection early\n");
+            return -1;
+        }
+        return 0;
+    }
+    conn->eof = 1;
+    if(conn->stash != NULL) /* decided once the stash was fed */
+        return 0;
+    return conn_finish(conn);
+}
+
+/* len body bytes were received and counted outside pcc_conn_input() (see pcc_pipeline.c) */
+void pcc_conn_add(struct pcc_conn* conn, uint64_t len, uint64_t printable, const uint64_t* hist) {
+    for(int i = 0; i < PCC_NCHARS; i++)
+        conn->hist[i] += hist[i];
+    conn->printable += printable;
+    conn->remaining -= len;
+    if(conn->remaining == 0)
+        conn_reply(conn);
+}
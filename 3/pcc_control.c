@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "pcc.h"
+
+/*
+* Control socket (-s path): a UNIX stream socket served by one thread of its own. Every connection to it
+* gets a text snapshot of the statistics so far and is closed, e.g. `socat - UNIX-CONNECT:path`:
+*   worker <w>: <requests> requests, <printable> printable chars   (one line per shard)
+*   total: <requests> requests, <printable> printable chars
+*   char '<c>' : <count> times                                     (95 lines, as printed on SIGINT)
+*   byte 0x<hh> : <count> times, pair '<c><c>' : <count> times      (-x only, likewise)
+* Shards are read through their seqlock (pcc_shard_read()), so a query never makes a worker wait and
+* never sees a connection's counts half committed. Each shard is consistent on its own; the workers
+* keep going while they are read one after the other. The totals include what a stats file brought in.
+*/
+
+const char* control_path; /* NULL: no control socket */
+static int control_socket = -1;
+static volatile int control_closing;
+static pthread_t control_thread;
+
+
+/* consistent copy of a shard while its worker may be committing into it */
+void pcc_shard_read(const struct pcc_shard* shard, struct pcc_shard* copy) {
+    uint64_t seq;
+    do {
+        while((seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE)) & 1) /* a commit is under way */
+            ;
+        for(int i = 0; i < PCC_NCHARS; i++)
+            copy->count[i] = __atomic_load_n(&shard->count[i], __ATOMIC_RELAXED);
+        copy->requests = __atomic_load_n(&shard->requests, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE); /* the counts are read before seq is checked again */
+    } while(__atomic_load_n(&shard->seq, __ATOMIC_RELAXED) != seq);
+    copy->seq = seq;
+}
+
+/* -x: consistent copy of the analytics x kept beside shard, the same way */
+void pcc_xshard_read(const struct pcc_shard* shard, const struct pcc_xcounts* x, struct pcc_xcounts* copy) {
+    uint64_t seq;
+    do {
+        while((seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        for(int b = 0; b < 256; b++)
+            copy->bytes[b] = __atomic_load_n(&x->bytes[b], __ATOMIC_RELAXED);
+        for(int i = 0; i < PCC_NCHARS * PCC_NCHARS; i++)
+            copy->pairs[i] = __atomic_load_n(&x->pairs[i], __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while(__atomic_load_n(&shard->seq, __ATOMIC_RELAXED) != seq);
+}
+
+/* -x: the byte and pair lines of every shard together (about 200 KB on the heap, not the stack) */
+static void xsnapshot(FILE* out) {
+    struct pcc_xcounts* total = calloc(2, sizeof(struct pcc_xcounts));
+    struct pcc_xcounts* copy = total + 1;
+
+    if(total == NULL){
+        perror("Error: failed formatting stats: ");
+        exit(1);
+    }
+    for(int w = 0; w < num_shards; w++){
+        pcc_xshard_read(&shards[w], &xshards[w], copy);
+        for(int b = 0; b < 256; b++)
+            total->bytes[b] += copy->bytes[b];
+        for(int i = 0; i < PCC_NCHARS * PCC_NCHARS; i++)
+            total->pairs[i] += copy->pairs[i];
+    }
+    for(int b = 0; b < 256; b++)
+        fprintf(out, "byte 0x%02x : %lu times\n", b, total->bytes[b]);
+    for(int i = 0; i < PCC_NCHARS * PCC_NCHARS; i++)
+        if(total->pairs[i] > 0)
+            fprintf(out, "pair '%c%c' : %lu times\n", i / PCC_NCHARS + 32, i % PCC_NCHARS + 32, total->pairs[i]);
+    free(total);
+}
+
+/* format the current stats of every shard into a malloc'ed text, its length in *len */
+static char* snapshot(size_t* len) {
+    uint64_t total[PCC_NCHARS];
+    uint64_t requests = pcc_restored_requests, printable = 0;
+    struct pcc_shard copy;
+    char* text = NULL;
+    FILE* out = open_memstream(&text, len);
+
+    if(out == NULL){
+        perror("Error: failed formatting stats: ");
+        exit(1);
+    }
+    for(int i = 0; i < PCC_NCHARS; i++){ /* from the stats file */
+        total[i] = pcc_restored[i];
+        printable += pcc_restored[i];
+    }
+    for(int w = 0; w < num_shards; w++){
+        uint64_t shard_printable = 0;
+        pcc_shard_read(&shards[w], &copy);
+        for(int i = 0; i < PCC_NCHARS; i++){
+            total[i] += copy.count[i];
+            shard_printable += copy.count[i];
+        }
+        requests += copy.requests;
+        printable += shard_printable;
+        fprintf(out, "worker %d: %lu requests, %lu printable chars\n", w, copy.requests, shard_printable);
+    }
+    fprintf(out, "total: %lu requests, %lu printable chars\n", requests, printable);
+    for(int i = 0; i < PCC_NCHARS; i++)
+        fprintf(out, "char '%c' : %lu times\n", (i+32), total[i]);
+    if(xshards != NULL)
+        xsnapshot(out);
+    fclose(out);
+    return text;
+}
+
+/* create control_path (replacing a stale one) and listen on it */
+static void control_open(void) {
+    struct sockaddr_un addr;
+
+    if(strlen(control_path) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "Error: control socket path too long\n");
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, control_path);
+    control_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(control_socket < 0){
+        perror("Error: failed creating control socket: ");
+        exit(1);
+    }
+    unlink(control_path); /* left over from a server that didn't stop cleanly */
+    if(bind(control_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(control_socket, 10) < 0){
+        perror("Error: failed binding control socket: ");
+        exit(1);
+    }
+}
+
+/* control thread: answer every connection with a snapshot until control_stop() */
+static void* control_loop(void* arg) {
+    (void)arg;
+    while(1){
+        size_t len, sent = 0;
+        char* text;
+        int fd = accept4(control_socket, NULL, NULL, SOCK_CLOEXEC);
+        if(fd < 0){
+            if(control_closing)
+                break;
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("Error: failed accepting control connection: ");
+            exit(1);
+        }
+        if(xshards != NULL && client_timeout_ms > 0){ /* -x: a few hundred KB, more than the socket buffer holds */
+            struct timeval tv = {.tv_sec = client_timeout_ms / 1000, .tv_usec = client_timeout_ms % 1000 * 1000};
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        }
+        text = snapshot(&len);
+        while(sent < len){ /* a few KB, fits the socket buffer: a reader that never reads can't hold us up */
+            ssize_t n = send(fd, text + sent, len - sent, MSG_NOSIGNAL);
+            if(n < 0){
+                if(errno == EINTR)
+                    continue;
+                break; /* the querier went away, its problem */
+            }
+            sent += n;
+        }
+        free(text);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* start answering on control_path with a thread of its own */
+void control_start(void) {
+    control_open();
+    if(pthread_create(&control_thread, NULL, control_loop, NULL) != 0){
+        perror("Error: failed creating control thread: ");
+        exit(1);
+    }
+}
+
+/* stop answering: wakes control_loop() out of accept(), waits for it and removes the socket file */
+void control_stop(void) {
+    control_closing = 1;
+    shutdown(control_socket, SHUT_RDWR);
+    pthread_join(control_thread, NULL);
+    close(control_socket);
+    unlink(control_path);
+}
@@ -0,0 +1,387 @@
+#include <string.h>
+#include <time.h>
+#include "pcc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PCC_X86 1
+#endif
+
+/*
+* Counting kernel: the printable total and the 95-bin histogram of a buffer, without a branch per byte.
+* Bins go to PCC_SUBHIST interleaved 32-bit sub-histograms indexed by the raw byte, so a run of equal
+* bytes updates different counters instead of waiting on its own previous store; they are folded into
+* the caller's 64-bit hist at the end (and every PCC_FOLD_BYTES, before a 32-bit counter could wrap).
+* The SIMD variants range-compare 16/32 bytes at a time and popcount the mask for the total, and skip the
+* sub-histograms for blocks without a printable byte.
+* pcc_count_init() picks among the variants the CPU has (CPUID, through __builtin_cpu_supports) at startup:
+* the best SIMD one, or for the histogram the fastest on a sample if asked to measure them.
+*/
+
+#define PCC_SUBHIST 4
+#define PCC_FOLD_BYTES (1u << 30) /* < 2^32 increments per counter between folds */
+#define PCC_SMALL 256 /* below this, clearing the sub-histograms costs more than it saves */
+#define PCC_CALIBRATE_BYTES 32768 /* sample each variant counts when they are measured, from L1 */
+#define PCC_CALIBRATE_RUNS 8
+
+typedef uint32_t subhist_t[PCC_SUBHIST][256];
+
+
+/* the plain byte loop, for short buffers and as the reference the other variants are tested against */
+uint64_t pcc_count_bytes(const unsigned char* buf, size_t len, uint64_t* hist) {
+    uint64_t printable = 0;
+    for(size_t i = 0; i < len; i++){
+        if((32 <= buf[i]) && (buf[i] <= 126)){ /* if the char is printable */
+            if(hist != NULL)
+                hist[buf[i]-32]++;
+            printable++;
+        }
+    }
+    return printable;
+}
+
+/* add the printable bins of sub into hist, returns their sum */
+static uint64_t fold(subhist_t sub, uint64_t* hist) {
+    uint64_t printable = 0;
+    for(int c = 32; c <= 126; c++){
+        uint64_t n = 0;
+        for(int k = 0; k < PCC_SUBHIST; k++)
+            n += sub[k][c];
+        hist[c-32] += n;
+        printable += n;
+    }
+    return printable;
+}
+
+/* every byte into the sub-histograms, printable or not */
+static void count_all(const unsigned char* buf, size_t len, subhist_t sub) {
+    size_t i = 0;
+    for(; i + 4 <= len; i += 4){
+        sub[0][buf[i]]++;
+        sub[1][buf[i+1]]++;
+        sub[2][buf[i+2]]++;
+        sub[3][buf[i+3]]++;
+    }
+    for(; i < len; i++)
+        sub[i & 3][buf[i]]++;
+}
+
+static uint64_t count_scalar(const unsigned char* buf, size_t len, uint64_t* hist) {
+    subhist_t sub;
+    uint64_t printable = 0;
+
+    if(len < PCC_SMALL || hist == NULL)
+        return pcc_count_bytes(buf, len, hist);
+    while(len > 0){
+        size_t n = len < PCC_FOLD_BYTES ? len : PCC_FOLD_BYTES;
+        memset(sub, 0, sizeof(subhist_t));
+        count_all(buf, n, sub);
+        printable += fold(sub, hist);
+        buf += n;
+        len -= n;
+    }
+    return printable;
+}
+
+#ifdef PCC_X86
+
+/*
+* a block with at least one printable byte goes whole into the sub-histograms (the non-printable bins are
+* never folded). Picking out only the printable bytes by their mask bits costs a mispredicted branch per
+* byte on mixed data, more than counting the rest for nothing; blocks without any are skipped.
+*/
+static inline void count_block(const unsigned char* p, uint32_t bits, unsigned width, subhist_t sub) {
+    if(bits != 0)
+        count_all(p, width, sub);
+}
+
+__attribute__((target("sse2,popcnt")))
+static uint64_t count_sse2(const unsigned char* buf, size_t len, uint64_t* hist) {
+    const __m128i lo = _mm_set1_epi8(32), span = _mm_set1_epi8(94);
+    subhist_t sub;
+    uint64_t printable = 0;
+
+    if(len < PCC_SMALL && hist != NULL)
+        return pcc_count_bytes(buf, len, hist);
+    while(len >= 16){
+        size_t n = (len < PCC_FOLD_BYTES ? len : PCC_FOLD_BYTES) & ~(size_t)15;
+        if(hist != NULL)
+            memset(sub, 0, sizeof(subhist_t));
+        for(size_t i = 0; i < n; i += 16){
+            /* printable <=> b - 32 <= 94 unsigned <=> min(b - 32, 94) == b - 32 */
+            __m128i t = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(buf + i)), lo);
+            uint32_t bits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(t, span), t));
+            printable += __builtin_popcount(bits);
+            if(hist != NULL)
+                count_block(buf + i, bits, 16, sub);
+        }
+        if(hist != NULL)
+            fold(sub, hist);
+        buf += n;
+        len -= n;
+    }
+    return printable + pcc_count_bytes(buf, len, hist);
+}
+
+__attribute__((target("avx2,popcnt,bmi")))
+static uint64_t count_avx2(const unsigned char* buf, size_t len, uint64_t* hist) {
+    const __m256i lo = _mm256_set1_epi8(32), span = _mm256_set1_epi8(94);
+    subhist_t sub;
+    uint64_t printable = 0;
+
+    if(len < PCC_SMALL && hist != NULL)
+        return pcc_count_bytes(buf, len, hist);
+    while(len >= 32){
+        size_t n = (len < PCC_FOLD_BYTES ? len : PCC_FOLD_BYTES) & ~(size_t)31;
+        if(hist != NULL)
+            memset(sub, 0, sizeof(subhist_t));
+        for(size_t i = 0; i < n; i += 32){
+            __m256i t = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)(buf + i)), lo);
+            uint32_t bits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(t, span), t));
+            printable += __builtin_popcount(bits);
+            if(hist != NULL)
+                count_block(buf + i, bits, 32, sub);
+        }
+        if(hist != NULL)
+            fold(sub, hist);
+        buf += n;
+        len -= n;
+    }
+    return printable + pcc_count_bytes(buf, len, hist);
+}
+
+static int has_sse2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt");
+}
+
+static int has_avx2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("bmi");
+}
+
+#endif
+
+static int always(void) {
+    return 1;
+}
+
+/*
+* Analytics kernel (-x): every byte value and every pair of adjacent printable chars, in one increment per
+* byte. A request's bytes go into a joint table indexed by the class of the previous byte and the byte itself
+* (struct pcc_joint), so the byte histogram is the column sums, the printable pairs are the printable part
+* of it, and a non-printable neighbour just lands in the row nobody reads as a pair; nothing is folded until
+* the request is done. The counters are 16-bit, so the 48 KB that take every byte stay in L1 like the plain
+* kernel's sub-histograms, and are widened into 32-bit ones every PCC_NARROW_MAX bytes. The AVX2 variant
+* builds the keys 32 at a time (range compare and interleave with the bytes) into a small buffer the scatter
+* reads back, and a block that only repeats the byte before it is one add of 32, where a plain scatter would
+* wait on the same counter 32 times.
+*/
+#define PCC_JOINT_KEYS 512 /* keys built before they are scattered: a buffer that stays in L1 */
+
+static inline unsigned joint_class(unsigned char b) {
+    unsigned char c = b - 32; /* wraps for b < 32 */
+    return c < PCC_NCHARS ? c : PCC_NCHARS;
+}
+
+/* count len bytes into narrow, *prev is the class of the byte before them */
+static void narrow_scalar(const unsigned char* buf, size_t len, uint16_t* narrow, unsigned* prev) {
+    unsigned p = *prev;
+    for(size_t i = 0; i < len; i++){
+        narrow[p << 8 | buf[i]]++;
+        p = joint_class(buf[i]);
+    }
+    *prev = p;
+}
+
+#ifdef PCC_X86
+__attribute__((target("avx2")))
+static void narrow_avx2(const unsigned char* buf, size_t len, uint16_t* narrow, unsigned* prev) {
+    const __m256i lo = _mm256_set1_epi8(32), other = _mm256_set1_epi8(PCC_NCHARS);
+    uint16_t keys[PCC_JOINT_KEYS] __attribute__((aligned(32)));
+    size_t i = 1;
+
+    if(len < 64){
+        narrow_scalar(buf, len, narrow, prev);
+        return;
+    }
+    narrow[*prev << 8 | buf[0]]++; /* its byte before came with an earlier call, or there is none */
+    while(i + 32 <= len){
+        size_t n = 0;
+        for(; n < PCC_JOINT_KEYS && i + 32 <= len; i += 32){
+            __m256i cur = _mm256_loadu_si256((const __m256i*)(buf + i));
+            __m256i before = _mm256_loadu_si256((const __m256i*)(buf + i - 1));
+            if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(cur, before)) == -1){ /* a run of buf[i - 1] */
+                narrow[joint_class(buf[i]) << 8 | buf[i]] += 32;
+                continue;
+            }
+            /* key = class of the byte before << 8 | byte; the unpacks work per 128-bit lane, any order counts the same */
+            __m256i c = _mm256_min_epu8(_mm256_sub_epi8(before, lo), other);
+            _mm256_store_si256((__m256i*)(keys + n), _mm256_unpacklo_epi8(cur, c));
+            _mm256_store_si256((__m256i*)(keys + n + 16), _mm256_unpackhi_epi8(cur, c));
+            n += 32;
+        }
+        for(size_t k = 0; k < n; k += 4){
+            narrow[keys[k]]++;
+            narrow[keys[k+1]]++;
+            narrow[keys[k+2]]++;
+            narrow[keys[k+3]]++;
+        }
+    }
+    *prev = joint_class(buf[i - 1]);
+    narrow_scalar(buf + i, len - i, narrow, prev);
+}
+#endif
+
+static void (*narrow_impl)(const unsigned char* buf, size_t len, uint16_t* narrow, unsigned* prev);
+
+/* count len more bytes of a request into j, at most PCC_JOINT_MAX between folds */
+void pcc_count_joint(struct pcc_joint* j, const unsigned char* buf, size_t len) {
+    if(narrow_impl == NULL){ /* threads racing here all store the same one */
+        narrow_impl = narrow_scalar;
+#ifdef PCC_X86
+        if(has_avx2())
+            narrow_impl = narrow_avx2;
+#endif
+    }
+    while(len > 0){
+        size_t n = len < PCC_NARROW_MAX - j->in_narrow ? len : PCC_NARROW_MAX - j->in_narrow;
+        narrow_impl(buf, n, j->narrow, &j->prev);
+        j->in_narrow += n;
+        j->counted += n;
+        if(j->in_narrow == PCC_NARROW_MAX){ /* before a 16-bit counter could wrap */
+            for(int i = 0; i < PCC_JOINT_SIZE; i++)
+                j->wide[i] += j->narrow[i];
+            memset(j->narrow, 0, sizeof(j->narrow));
+            j->in_narrow = 0;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+* add what j counted since the last fold into the byte histogram bytes[256] and the printable pairs
+* pairs[95 * 95], and clear it (prev stays). Groups of counters that are all zero are skipped, so a small
+* request doesn't pay for the whole table
+*/
+void pcc_joint_fold(struct pcc_joint* j, uint64_t* bytes, uint64_t* pairs) {
+    int widened = j->counted > j->in_narrow; /* otherwise wide is all zero */
+
+    for(int i = 0; i < PCC_JOINT_SIZE; i += 16){
+        uint32_t any = 0;
+        for(int k = i; k < i + 16; k++)
+            any |= j->narrow[k] | (widened ? j->wide[k] : 0);
+        if(any == 0)
+            continue;
+        for(int k = i; k < i + 16; k++){
+            uint64_t n = (uint64_t)j->narrow[k] + j->wide[k];
+            int row = k >> 8, b = k & 255;
+            bytes[b] += n;
+            if(row < PCC_NCHARS && 32 <= b && b <= 126)
+                pairs[row * PCC_NCHARS + b - 32] += n;
+            j->narrow[k] = 0;
+            j->wide[k] = 0;
+        }
+    }
+    j->counted = 0;
+    j->in_narrow = 0;
+}
+
+/* best first, the order pcc_count_init() picks in */
+const struct pcc_counter pcc_counters[] = {
+#ifdef PCC_X86
+    {"avx2", count_avx2, has_avx2},
+    {"sse2", count_sse2, has_sse2},
+#endif
+    {"scalar", count_scalar, always},
+    {NULL, NULL, NULL},
+};
+
+static const struct pcc_counter* hist_counter; /* NULL until pcc_count_init() */
+static const struct pcc_counter* total_counter;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* best of PCC_CALIBRATE_RUNS of c counting sample into a histogram, in ns */
+static double calibrate(const struct pcc_counter* c, const unsigned char* sample) {
+    uint64_t hist[PCC_NCHARS];
+    double best = 0;
+    for(int r = 0; r < PCC_CALIBRATE_RUNS; r++){
+        double t0 = now_ns();
+        c->count(sample, PCC_CALIBRATE_BYTES, hist);
+        double t = now_ns() - t0;
+        if(r == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+/* the supported variant that counts a sample (mostly text, some binary) into a histogram fastest */
+static const struct pcc_counter* fastest_hist(void) {
+    const struct pcc_counter* c = NULL;
+    unsigned char sample[PCC_CALIBRATE_BYTES];
+    uint32_t seed = 1;
+    double best = 0;
+
+    for(int i = 0; i < PCC_CALIBRATE_BYTES; i++){
+        seed = seed * 1103515245 + 12345;
+        sample[i] = (seed >> 16) % 8 ? 32 + (seed >> 20) % 95 : seed >> 24;
+    }
+    for(const struct pcc_counter* v = pcc_counters; v->name != NULL; v++){
+        if(!v->supported())
+            continue;
+        double t = calibrate(v, sample);
+        if(c == NULL || t < best){
+            c = v;
+            best = t;
+        }
+    }
+    return c;
+}
+
+/*
+* choose the variants pcc_count() uses, before any thread counts: the first one the CPU supports, so the
+* same CPU always gets the same one. With measure the histogram gets the one that counts a sample fastest
+* instead: its bins are a scatter of one increment per byte whatever the variant, and on some CPUs the SIMD
+* range compare in front of it costs more than skipping the rare blocks without a printable byte saves.
+* Measuring takes a few hundred microseconds and may pick differently from run to run when two are close.
+* RETURNS - the name of the variant used with a histogram
+*/
+const char* pcc_count_init(int measure) {
+    const struct pcc_counter* c = pcc_counters;
+
+    while(!c->supported()) /* scalar always is */
+        c++;
+    __atomic_store_n(&total_counter, c, __ATOMIC_RELAXED);
+    if(measure)
+        c = fastest_hist();
+    __atomic_store_n(&hist_counter, c, __ATOMIC_RELEASE);
+    return c->name;
+}
+
+/* name of the variant pcc_count() uses with a histogram */
+const char* pcc_count_variant(void) {
+    const struct pcc_counter* c = __atomic_load_n(&hist_counter, __ATOMIC_ACQUIRE);
+    return c != NULL ? c->name : pcc_count_init(0);
+}
+
+/*
+* count the printable chars of buf into hist (if not NULL), returns how many there were.
+* With hist that is one counter increment per byte, well below memory bandwidth whichever variant runs;
+* without it only the total is computed, which the SIMD variants do at close to memory bandwidth
+*/
+uint64_t pcc_count(const unsigned char* buf, size_t len, uint64_t* hist) {
+    const struct pcc_counter* c = __atomic_load_n(&hist_counter, __ATOMIC_ACQUIRE);
+    if(c == NULL){ /* a program that never called pcc_count_init() gets the CPUID pick */
+        pcc_count_init(0);
+        c = __atomic_load_n(&hist_counter, __ATOMIC_ACQUIRE);
+    }
+    if(hist == NULL)
+        c = total_counter; /* stored before hist_counter */
+    return c->count(buf, len, hist);
+}
@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "pcc.h"
+
+/*
+* Throughput of every counting kernel variant the CPU supports, in GB/s, on a few kinds of input:
+* random bytes, text (all printable) and a single repeated byte (the worst case for a plain histogram).
+* "hist" is what the server does (total and 95 bins), "total" only computes the printable count;
+* "bytes" is the plain byte loop the kernel replaced; "joint" is the -x analytics kernel (every byte
+* value and printable pair), folded once at the end as after a request.
+*
+* gcc -O3 -Wall -std=gnu11 -o pcc_count_bench pcc_count_bench.c pcc_count.c
+* ./pcc_count_bench [-s size_mb] [-r runs]
+*/
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* best of runs, in GB/s */
+static double measure(pcc_count_fn count, const unsigned char* buf, size_t len, int with_hist, int runs) {
+    uint64_t hist[PCC_NCHARS];
+    double best = 0;
+    for(int r = 0; r < runs; r++){
+        memset(hist, 0, sizeof(hist));
+        double t0 = now_sec();
+        volatile uint64_t printable = count(buf, len, with_hist ? hist : NULL);
+        double t = now_sec() - t0;
+        (void)printable;
+        if(best == 0 || t < best)
+            best = t;
+    }
+    return len / best / 1e9;
+}
+
+/* -x: pcc_count_joint() and the fold, best of runs, in GB/s */
+static double measure_joint(const unsigned char* buf, size_t len, int runs) {
+    struct pcc_joint* joint = aligned_alloc(64, sizeof(struct pcc_joint));
+    struct pcc_xcounts* x = calloc(1, sizeof(struct pcc_xcounts));
+    double best = 0;
+    if(joint == NULL || x == NULL){
+        perror("Error: malloc: ");
+        exit(1);
+    }
+    memset(joint, 0, sizeof(struct pcc_joint));
+    for(int r = 0; r < runs; r++){
+        double t0 = now_sec();
+        joint->prev = PCC_NCHARS;
+        for(size_t done = 0; done < len; done += PCC_JOINT_MAX){
+            pcc_count_joint(joint, buf + done, len - done < PCC_JOINT_MAX ? len - done : PCC_JOINT_MAX);
+            pcc_joint_fold(joint, x->bytes, x->pairs);
+        }
+        double t = now_sec() - t0;
+        if(best == 0 || t < best)
+            best = t;
+    }
+    free(joint);
+    free(x);
+    return len / best / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+    size_t size_mb = 256;
+    int runs = 5;
+    int opt;
+    const char* inputs[] = {"random", "text", "repeated"};
+
+    while((opt = getopt(argc, argv, "s:r:")) != -1){
+        if(opt == 's' && atol(optarg) > 0)
+            size_mb = atol(optarg);
+        else if(opt == 'r' && atoi(optarg) > 0)
+            runs = atoi(optarg);
+        else{
+            fprintf(stderr, "usage: %s [-s size_mb] [-r runs]\n", argv[0]);
+            exit(1);
+        }
+    }
+    size_t len = size_mb << 20;
+    unsigned char* buf = malloc(len);
+    if(buf == NULL){
+        perror("Error: malloc: ");
+        exit(1);
+    }
+
+    printf("dispatch picks %s", pcc_count_init(0));
+    printf(", measured (pcc_server -g) %s with a histogram\n", pcc_count_init(1));
+    printf("%-10s %-8s %10s %10s\n", "input", "variant", "hist GB/s", "total GB/s");
+    for(int in = 0; in < 3; in++){
+        srandom(1);
+        for(size_t i = 0; i < len; i++){
+            if(in == 0)
+                buf[i] = random();
+            else if(in == 1)
+                buf[i] = 32 + random() % 95;
+            else
+                buf[i] = 'a';
+        }
+        printf("%-10s %-8s %10.2f %10.2f\n", inputs[in], "bytes",
+               measure(pcc_count_bytes, buf, len, 1, runs), measure(pcc_count_bytes, buf, len, 0, runs));
+        for(const struct pcc_counter* c = pcc_counters; c->name != NULL; c++){
+            if(!c->supported())
+                continue;
+            printf("%-10s %-8s %10.2f %10.2f\n", inputs[in], c->name,
+                   measure(c->count, buf, len, 1, runs), measure(c->count, buf, len, 0, runs));
+            fflush(stdout);
+        }
+        printf("%-10s %-8s %10.2f %10s\n", inputs[in], "joint", measure_joint(buf, len, runs), "-");
+    }
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pcc.h"
+
+/*
+* Randomized check of every counting kernel variant the CPU supports against the plain byte loop:
+* random lengths and alignments, inputs from all-binary to all-printable, with and without a histogram,
+* counted into a histogram that already holds counts; and the -x joint kernel, counted in random pieces
+* and folded, against a byte loop over every byte value and printable pair. Exits 1 on the first mismatch.
+*
+* gcc -O2 -Wall -std=gnu11 -o pcc_count_test pcc_count_test.c pcc_count.c
+* ./pcc_count_test [iterations] [seed]
+*/
+
+#define MAX_LEN 70000
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    unsigned seed = argc > 2 ? atoi(argv[2]) : 1;
+    unsigned char* buf = malloc(MAX_LEN + 64);
+    uint64_t want[PCC_NCHARS], got[PCC_NCHARS];
+    struct pcc_joint* joint = aligned_alloc(64, sizeof(struct pcc_joint));
+    struct pcc_xcounts* xwant = calloc(2, sizeof(struct pcc_xcounts));
+    struct pcc_xcounts* xgot = xwant + 1;
+
+    if(buf == NULL || joint == NULL || xwant == NULL){
+        perror("Error: malloc: ");
+        exit(1);
+    }
+    memset(joint, 0, sizeof(struct pcc_joint));
+    srandom(seed);
+    for(int it = 0; it < iterations; it++){
+        size_t off = random() % 64; /* unaligned starts */
+        size_t len = random() % 4 == 0 ? random() % 600 : random() % MAX_LEN;
+        int printable_pct = random() % 101;
+        int run_pct = random() % 3 == 0 ? random() % 101 : 0; /* runs of one byte value, long ones too */
+        for(size_t i = 0; i < len; i++){
+            if(i > 0 && random() % 100 < run_pct)
+                buf[off + i] = buf[off + i - 1];
+            else if(random() % 100 < printable_pct)
+                buf[off + i] = 32 + random() % 95;
+            else
+                buf[off + i] = random() % 2 ? random() % 32 : 127 + random() % 129;
+        }
+        for(int i = 0; i < PCC_NCHARS; i++)
+            want[i] = random() % 1000;
+        memcpy(got, want, sizeof(got));
+        uint64_t want_total = pcc_count_bytes(buf + off, len, want);
+
+        for(const struct pcc_counter* c = pcc_counters; c->name != NULL; c++){
+            if(!c->supported())
+                continue;
+            uint64_t hist[PCC_NCHARS];
+            memcpy(hist, got, sizeof(hist));
+            uint64_t total = c->count(buf + off, len, hist);
+            uint64_t total_only = c->count(buf + off, len, NULL);
+            if(total != want_total || total_only != want_total || memcmp(hist, want, sizeof(hist)) != 0){
+                fprintf(stderr, "Error: %s differs from the byte loop (seed %u, iteration %d, offset %zu, length %zu)\n",
+                        c->name, seed, it, off, len);
+                exit(1);
+            }
+        }
+
+        memset(xwant, 0, 2 * sizeof(struct pcc_xcounts));
+        for(size_t i = 0; i < len; i++){
+            unsigned char b = buf[off + i];
+            xwant->bytes[b]++;
+            if(i > 0 && 32 <= buf[off + i - 1] && buf[off + i - 1] <= 126 && 32 <= b && b <= 126)
+                xwant->pairs[(buf[off + i - 1] - 32) * PCC_NCHARS + b - 32]++;
+        }
+        joint->prev = PCC_NCHARS;
+        for(size_t done = 0, n; done < len; done += n){ /* the pieces a request arrives in */
+            n = 1 + random() % (len - done);
+            pcc_count_joint(joint, buf + off + done, n);
+        }
+        pcc_joint_fold(joint, xgot->bytes, xgot->pairs);
+        if(memcmp(xgot, xwant, sizeof(struct pcc_xcounts)) != 0){
+            fprintf(stderr, "Error: joint differs from the byte loop (seed %u, iteration %d, offset %zu, length %zu)\n",
+                    seed, it, off, len);
+            exit(1);
+        }
+    }
+    for(const struct pcc_counter* c = pcc_counters; c->name != NULL; c++)
+        printf("%-8s %s\n", c->name, c->supported() ? "ok" : "not supported here");
+    printf("%-8s ok\n", "joint");
+    free(buf);
+    free(joint);
+    free(xwant);
+    return 0;
+}
@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include "pcc.h"
+
+/*
+* Event-driven mode (-e): every loop thread multiplexes its connections with an edge-triggered epoll.
+* Sockets are non-blocking and each connection is only its struct pcc_conn, taken from a fixed pool of
+* max_conns slots per loop; bodies are counted as they arrive, so the loop's read buffer is the only data
+* buffer. When the pool is full the loop stops accepting and the kernel backlog holds new clients until a
+* slot frees up, so thousands of idle or slow clients cost a few hundred bytes each, and a client that
+* stalls or trickles its bytes gives its slot back when its deadline in the loop's timer wheel expires.
+*/
+
+#define READ_BUFFER_SIZE 1048576 /* Allocations of up to 1 MB are OK. */
+#define MAX_EVENTS 256
+
+int stop_fd = -1; /* eventfd written by main on SIGINT, level-triggered so that every loop sees it */
+int max_conns = 16384;
+int accept_batch = 0; /* -m: connections taken per wakeup of the listening socket, 0: all that wait */
+
+struct loop {
+    int epfd;
+    struct pcc_shard* shard;
+    struct pcc_conn* pool;
+    int* free_slots; /* stack of unused pool indices */
+    int nfree;
+    int accepting; /* listen_socket is registered */
+    char* buf;
+    struct pcc_wheel wheel;
+};
+
+static char listen_tag, stop_tag; /* epoll data for the two fds that are not connections */
+
+
+static void watch_listen(struct loop* l, int on) {
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &listen_tag};
+    if(on == l->accepting)
+        return;
+    if(epoll_ctl(l->epfd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, listen_socket, &ev) < 0){
+        perror("Error: failed updating epoll: ");
+        exit(1);
+    }
+    l->accepting = on;
+}
+
+/* done with a connection (its answered requests are committed already), give the slot back */
+static void conn_close(struct loop* l, struct pcc_conn* conn) {
+    pcc_timer_cancel(&l->wheel, &conn->timer);
+    close(conn->fd); /* also removes it from the epoll set */
+    pcc_conn_free(conn);
+    l->free_slots[l->nfree++] = conn - l->pool;
+    conn->fd = -1;
+    if(!stopping)
+        watch_listen(l, 1);
+}
+
+/*
+* accept what is waiting, as long as there are free slots: everything, or accept_batch connections so the
+* ones already in the loop get their turn in between (the listening socket is level-triggered, the rest
+* wakes this or another loop again)
+*/
+static void loop_accept(struct loop* l) {
+    for(int n = 0; l->nfree > 0; n++){
+        if(accept_batch > 0 && n == accept_batch)
+            return;
+        int fd = accept4(listen_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("Error: failed accepting connection: ");
+            exit(1);
+        }
+        struct pcc_conn* conn = &l->pool[l->free_slots[--l->nfree]];
+        pcc_conn_reset(conn, fd);
+        pcc_conn_deadline(&l->wheel, conn); /* for its header */
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn};
+        if(epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+            perror("Error: failed adding connection to epoll: ");
+            exit(1);
+        }
+    }
+    watch_listen(l, 0); /* pool exhausted, leave the rest in the backlog */
+}
+
+/* push out as much of out[] as the socket takes. returns 1 when all sent, 0 to wait for EPOLLOUT, -1 on error */
+static int conn_send(struct pcc_conn* conn) {
+    while(conn->out_off < conn->out_len){
+        ssize_t nsent = send(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off, MSG_NOSIGNAL);
+        if(nsent < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if(errno == EINTR)
+                continue;
+            int err = errno; /* perror() may change errno */
+            perror("Error: failed writing to client: ");
+            if(is_client_error(err))
+                return -1;
+            exit(1);
+        }
+        conn->out_off += nsent;
+    }
+    return 1;
+}
+
+/*
+* drain the socket into the protocol engine, until it would block or the connection can't take more input.
+* returns 0 if the connection is fine so far, 1 if the client is done, -1 if it failed
+*/
+static int conn_read(struct loop* l, struct pcc_conn* conn) {
+    while(conn->state != PCC_REPLY && !conn->eof){
+        ssize_t bytes_read = read(conn->fd, l->buf, READ_BUFFER_SIZE);
+        if(bytes_read < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if(errno == EINTR)
+                continue;
+            int err = errno; /* perror() may change errno */
+            perror("Error: failed reading from client: ");
+            if(is_client_error(err))
+                return -1;
+            exit(1);
+        }
+        if(bytes_read == 0) /* client closed its side: fine only between two v2 requests */
+            return pcc_conn_eof(conn);
+        pcc_conn_feed(conn, l->buf, bytes_read); /* v1 ignores anything past the request, v2 keeps it */
+        if(conn->failed)
+            return -1;
+    }
+    return 0;
+}
+
+/* errors and hangups show up as failed reads and writes, so every event is handled the same way */
+static void conn_event(struct loop* l, struct pcc_conn* conn) {
+    int done;
+    if(conn->fd < 0) /* closed earlier in this batch */
+        return;
+    while(1){
+        if(conn->out_off < conn->out_len){
+            done = conn_send(conn);
+            if(done == 0) /* wait for EPOLLOUT */
+                break;
+            if(done > 0){ /* the replies went out: commit them, then take input again */
+                pcc_commit(l->shard, conn);
+                done = pcc_conn_sent(conn);
+            }
+        }
+        else{
+            done = conn_read(l, conn);
+            if(done == 0 && conn->out_off == conn->out_len) /* wait for EPOLLIN */
+                break;
+        }
+        if(done != 0){
+            conn_close(l, conn);
+            return;
+        }
+    }
+    pcc_conn_deadline(&l->wheel, conn);
+}
+
+/* a connection missed its deadline: drop it, unanswered requests and all */
+static void conn_expired(struct pcc_timer* t, void* arg) {
+    struct pcc_conn* conn = (struct pcc_conn*)((char*)t - offsetof(struct pcc_conn, timer));
+    fprintf(stderr, "Error: client timed out\n");
+    conn_close(arg, conn);
+}
+
+/* thread body for -e: one epoll loop counting into its own shard, until SIGINT and all its clients are done */
+void* event_loop(void* shard) {
+    struct loop l = {.shard = shard};
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &stop_tag};
+
+    l.pool = calloc(max_conns, sizeof(struct pcc_conn));
+    l.free_slots = malloc(sizeof(int) * max_conns);
+    l.buf = malloc(READ_BUFFER_SIZE);
+    l.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(l.pool == NULL || l.free_slots == NULL || l.buf == NULL || l.epfd < 0){
+        perror("Error: failed setting up event loop: ");
+        exit(1);
+    }
+    for(int i = 0; i < max_conns; i++)
+        l.free_slots[l.nfree++] = max_conns - 1 - i;
+    if(epoll_ctl(l.epfd, EPOLL_CTL_ADD, stop_fd, &ev) < 0){
+        perror("Error: failed updating epoll: ");
+        exit(1);
+    }
+    watch_listen(&l, 1);
+    pcc_wheel_init(&l.wheel);
+
+    while(!stopping || l.nfree < max_conns){ /* after SIGINT, finish the connections in flight */
+        int n = epoll_wait(l.epfd, events, MAX_EVENTS, l.wheel.armed > 0 ? PCC_TICK_MS : -1);
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            perror("Error: failed waiting for events: ");
+            exit(1);
+        }
+        for(int i = 0; i < n; i++){
+            if(events[i].data.ptr == &listen_tag){
+                if(!stopping)
+                    loop_accept(&l);
+            }
+            else if(events[i].data.ptr == &stop_tag){
+                watch_listen(&l, 0);
+                epoll_ctl(l.epfd, EPOLL_CTL_DEL, stop_fd, NULL);
+            }
+            else{
+                conn_event(&l, events[i].data.ptr);
+            }
+        }
+        pcc_wheel_advance(&l.wheel, pcc_ticks(), conn_expired, &l);
+    }
+    close(l.epfd);
+    free(l.pool);
+    free(l.free_slots);
+    free(l.buf);
+    return NULL;
+}
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "pcc.h"
+
+/*
+* Pipelined body for one big stream (-p counters, blocking workers only): the worker becomes a receive
+* thread that fills a ring of 1 MB buffers from the socket, while `counters` threads of its own take the
+* filled buffers, count them into private histograms and hand them back. Receiving never waits for
+* counting unless every buffer is full, and counting of a single multi-GB upload uses several cores.
+* The private histograms are added into the connection once the whole body was received and counted.
+*/
+
+#define PIPE_BUFFER_SIZE 1048576 /* Allocations of up to 1 MB are OK. */
+
+int pipeline_counters = 0; /* counting threads per big stream, 0: the worker counts as it reads */
+uint64_t pipeline_min = (uint64_t)64 << 20; /* bodies smaller than this are not worth the threads */
+
+struct pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t filled_cv; /* a buffer was filled, or the body ended */
+    pthread_cond_t free_cv; /* a buffer was counted */
+    int nbufs;
+    char** bufs;
+    size_t* lens;
+    int* filled; /* FIFO of filled buffer indices */
+    int filled_head, nfilled;
+    int* free_bufs; /* stack of empty buffer indices */
+    int nfree;
+    int done; /* the receiver won't fill any more buffers */
+    int failed; /* ... because the connection failed: don't bother counting the rest */
+};
+
+struct counter {
+    struct pipeline* p;
+    pthread_t thread;
+    uint64_t printable;
+    uint64_t hist[PCC_NCHARS];
+} __attribute__((aligned(64))); /* counters never write the same cache line */
+
+
+static void* counter_main(void* arg) {
+    struct counter* c = arg;
+    struct pipeline* p = c->p;
+    int idx, skip;
+
+    while(1){
+        pthread_mutex_lock(&p->lock);
+        while(p->nfilled == 0 && !p->done)
+            pthread_cond_wait(&p->filled_cv, &p->lock);
+        if(p->nfilled == 0){ /* done and nothing left */
+            pthread_mutex_unlock(&p->lock);
+            return NULL;
+        }
+        idx = p->filled[p->filled_head];
+        p->filled_head = (p->filled_head + 1) % p->nbufs;
+        p->nfilled--;
+        skip = p->failed;
+        pthread_mutex_unlock(&p->lock);
+
+        if(!skip)
+            c->printable += pcc_count((const unsigned char*)p->bufs[idx], p->lens[idx], c->hist);
+
+        pthread_mutex_lock(&p->lock);
+        p->free_bufs[p->nfree++] = idx;
+        pthread_cond_signal(&p->free_cv);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+/* read exactly len bytes of the body into buf. returns 0, or 1 if the connection failed */
+static int fill(int socket_fd, char* buf, size_t len) {
+    size_t have = 0;
+    while(have < len){
+        ssize_t bytes_read = read(socket_fd, buf + have, len - have);
+        if(bytes_read < 0){
+            if(errno == EINTR)
+                continue;
+            int err = errno; /* perror() may change errno */
+            perror("Error: failed reading from client: ");
+            if(is_client_error(err))
+                return 1;
+            exit(1);
+        }
+        if(bytes_read == 0){ /* client closed the connection before sending everything */
+            fprintf(stderr, "Error: client closed the connection early\n");
+            return 1;
+        }
+        have += bytes_read;
+    }
+    return 0;
+}
+
+/*
+* receive and count the rest of conn's body (conn is in PCC_BODY) with pipeline_counters counting threads.
+* returns 0 with the reply ready in conn, or 1 if the connection failed (conn's counts must then be discarded)
+*/
+int pcc_pipeline_body(struct pcc_conn* conn) {
+    struct pipeline p;
+    struct counter* counters;
+    uint64_t remaining = conn->remaining;
+    uint64_t hist[PCC_NCHARS] = {0};
+    uint64_t printable = 0;
+    int failed = 0;
+    int idx;
+
+    memset(&p, 0, sizeof(p));
+    p.nbufs = 2 * pipeline_counters + 1; /* every counter busy on one, as many queued, one being filled */
+    p.bufs = calloc(p.nbufs, sizeof(char*));
+    p.lens = calloc(p.nbufs, sizeof(size_t));
+    p.filled = malloc(sizeof(int) * p.nbufs);
+    p.free_bufs = malloc(sizeof(int) * p.nbufs);
+    counters = aligned_alloc(64, sizeof(struct counter) * pipeline_counters);
+    if(p.bufs == NULL || p.lens == NULL || p.filled == NULL || p.free_bufs == NULL || counters == NULL){
+        perror("Error: failed allocating pipeline: ");
+        exit(1);
+    }
+    for(int i = 0; i < p.nbufs; i++){
+        p.bufs[i] = malloc(PIPE_BUFFER_SIZE);
+        if(p.bufs[i] == NULL){
+            perror("Error: failed allocating pipeline: ");
+            exit(1);
+        }
+        p.free_bufs[p.nfree++] = i;
+    }
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.filled_cv, NULL);
+    pthread_cond_init(&p.free_cv, NULL);
+    memset(counters, 0, sizeof(struct counter) * pipeline_counters);
+    for(int c = 0; c < pipeline_counters; c++){
+        counters[c].p = &p;
+        if(pthread_create(&counters[c].thread, NULL, counter_main, &counters[c]) != 0){
+            perror("Error: failed creating counting thread: ");
+            exit(1);
+        }
+    }
+
+    /* receive: take an empty buffer, fill it from the socket, queue it for the counters */
+    while(remaining > 0){
+        size_t len = remaining < PIPE_BUFFER_SIZE ? remaining : PIPE_BUFFER_SIZE;
+        pthread_mutex_lock(&p.lock);
+        while(p.nfree == 0)
+            pthread_cond_wait(&p.free_cv, &p.lock);
+        idx = p.free_bufs[--p.nfree];
+        pthread_mutex_unlock(&p.lock);
+
+        if(fill(conn->fd, p.bufs[idx], len) != 0){
+            failed = 1;
+            break;
+        }
+        remaining -= len;
+        p.lens[idx] = len;
+
+        pthread_mutex_lock(&p.lock);
+        p.filled[(p.filled_head + p.nfilled) % p.nbufs] = idx;
+        p.nfilled++;
+        pthread_cond_signal(&p.filled_cv);
+        pthread_mutex_unlock(&p.lock);
+    }
+
+    pthread_mutex_lock(&p.lock);
+    p.done = 1;
+    p.failed = failed;
+    pthread_cond_broadcast(&p.filled_cv);
+    pthread_mutex_unlock(&p.lock);
+    for(int c = 0; c < pipeline_counters; c++){ /* combine the partial histograms */
+        pthread_join(counters[c].thread, NULL);
+        printable += counters[c].printable;
+        for(int i = 0; i < PCC_NCHARS; i++)
+            hist[i] += counters[c].hist[i];
+    }
+    if(!failed)
+        pcc_conn_add(conn, conn->remaining, printable, hist);
+
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.filled_cv);
+    pthread_cond_destroy(&p.free_cv);
+    for(int i = 0; i < p.nbufs; i++)
+        free(p.bufs[i]);
+    free(p.bufs);
+    free(p.lens);
+    free(p.filled);
+    free(p.free_bufs);
+    free(counters);
+    return failed;
+}
@@ -1,6 +1,16 @@
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <string.h>
@@ -10,57 +20,74 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <endian.h>
+#include <fcntl.h>
 #include <signal.h>
-
-
-int called_sigint_when_busy;
-int is_processing_client; /* if we are processing client's request */
-uint64_t pcc_total[95]; /* array of 95 count for each printable char seen and his count offset -32*/
-
-
-void my_sigint_handler(){
-    if(is_processing_client == 0) { /* if not processing client's request */
-        for(int i = 0; i < 95; i++) { /* print pcc_total */
-            printf("char '%c' : %lu times\n", (i+32), pcc_total[i]);
-        }
-        exit(0);
-    }
-    else{ /* if processing client's request now */
-        called_sigint_when_busy = 1; /* remember to not take another request after this one. after this one print stats */
-    }
-}
-
-/* we update the SIGINT handler to: wait for proccesing client to end, then print statisticts, then exit */
-void update_sigint_handler() 
-{   
-    /* https://www.youtube.com/watch?v=jF-1eFhyz1U&t=220s here learned how to create the handler */
-    int state_sigint;
-    state_sigint = 0;
-    struct sigaction sigi;
-    sigi.sa_handler = my_sigint_handler; /* The default action is to terminate the process */
-    sigi.sa_flags = SA_RESTART;  /* avoiding the EINTR, SA_RESTART lets handler work acoording to documentation in https://www.gnu.org/software/libc/manual/html_node/Flags-for-Sigaction.html and the video in up link */
-    state_sigint = sigaction(SIGINT, &sigi, NULL);
-    if (state_sigint != 0) /* if handle fails */
-    {
-        perror("Error: failed to update SIGINT handler: ");
-        exit(1);
-    }
-    return;
-}
-
-
-int send_C(int socket_fd, void* buffer) {
+#include <pthread.h>
+#include "pcc.h"
+
+/* gcc -O3 -Wall -std=gnu11 -pthread -o pcc_server pcc_server.c pcc_conn.c pcc_count.c pcc_epoll.c pcc_uring.c pcc_pipeline.c pcc_control.c pcc_statsfile.c pcc_timer.c */
+
+/*
+* pcc_server <port> [-t threads] [-e | -u] [-c max_connections] [-p counters] [-s control_socket]
+*            [-f stats_file [-n fsync_every]] [-k processes] [-l unix_socket] [-a] [-i timeout_ms] [-x]
+*            [-b backlog] [-d defer_secs] [-q fastopen_queue] [-m accept_batch] [-g]
+* every worker thread serves connections on its own and counts into its own shard of the statistics;
+* the shards are merged into pcc_total only when the server stops (SIGINT). With -s the running server
+* also answers every connection to the UNIX socket control_socket with the current stats (see pcc_control.c).
+* With -f the totals start from stats_file and every commit is added to it as well (see pcc_statsfile.c).
+* By default a worker serves one blocking connection at a time; with -e every worker is an epoll
+* event loop holding up to max_connections connections at once (see pcc_epoll.c); -u does the same on
+* io_uring (see pcc_uring.c) and falls back to epoll where the kernel can't.
+* With -p a blocking worker receives a big body while `counters` threads count it (see pcc_pipeline.c).
+* With -k the server is that many processes instead (see prefork()), each with its threads as above.
+* With -l clients on this host can also connect to the UNIX socket unix_socket, served by as many more
+* blocking workers (in any mode), where they may pass their open file instead of its bytes (PCC_FD).
+* With -a clients are trusted to count their files themselves and send only the counts (PCC_HIST).
+* A client that takes longer than timeout_ms (default 30 s, 0: never) to send its header, to send more of
+* its body or to take its replies is dropped; a trickle of bytes doesn't count as progress (see pcc_timer.c).
+* With -x the server also counts every byte value and every pair of adjacent printable chars, kept in
+* xshards beside the shards and printed after the 95 bins (by the control socket as well); not with -p.
+* Accept path (see open_listen_socket()): -b is the listen backlog (default 10, SOMAXCONN with -e / -u),
+* -d defers accepting a client until its first bytes arrived (TCP_DEFER_ACCEPT, giving up on it after about
+* defer_secs), -q takes TCP Fast Open requests (their header rides on the SYN, pcc_client -f), and -m caps
+* the connections an epoll loop accepts per wakeup (default all that wait).
+* The counting kernel is chosen at startup by what the CPU supports; -g measures the variants on a sample
+* instead and counts histograms with the fastest, printing its name to stderr (see pcc_count_init()).
+*/
+
+uint64_t pcc_total[PCC_NCHARS]; /* array of 95 count for each printable char seen and his count offset -32*/
+struct pcc_xcounts pcc_xtotal; /* -x: xshards merged when the server stops */
+uint64_t pcc_restored[PCC_NCHARS]; /* what the stats file held at startup, part of pcc_total */
+uint64_t pcc_restored_requests;
+struct pcc_shard *shards; /* one per worker (of every process with -k) */
+struct pcc_xcounts *xshards; /* -x: the analytics of shards[w] in xshards[w], NULL otherwise */
+int num_shards;
+int num_workers; /* per process */
+int unix_workers; /* per process, serving unix_socket after the num_workers others */
+int listen_socket; /* socket for listening */
+int unix_socket = -1; /* -l */
+int unix_stop_fd = -1; /* eventfd written on SIGINT, wakes the unix workers */
+int listen_backlog = -1; /* -b, -1: by mode */
+int defer_accept_secs; /* -d, 0: accept on the handshake */
+int fastopen_queue; /* -q, 0: no TCP Fast Open */
+volatile int stopping; /* set once SIGINT arrived, workers leave after their current clients */
+
+
+int send_C(int socket_fd, void* buffer, int len) {
     int total_written, nsent, not_written;
     total_written = 0;
-    not_written = sizeof(uint64_t);
+    not_written = len;
     while(not_written > 0){
-        nsent = write(socket_fd, buffer + total_written, not_written); /* write the printable_char_count to the client */
+        nsent = send(socket_fd, buffer + total_written, not_written, MSG_NOSIGNAL); /* write the printable_char_count to the client, EPIPE instead of SIGPIPE */
         if(nsent < 0){
+            if(errno == EINTR)
+                continue;
+            int err = errno; /* perror() may change errno */
             perror("Error: failed writing to client: ");
-            if((errno == ETIMEDOUT) || (errno == ECONNRESET) || (errno == EPIPE) || (errno == EOF))
+            if(is_client_error(err))
             {
                 return 1;
-            } 
+            }
             else
             {
                 exit(1);
@@ -71,44 +98,173 @@ int send_C(int socket_fd, void* buffer) {
     }
     return 0;
 }
-    
 
-int main(int argc, char *argv[]){
+/* read() that also takes the files a UNIX client passes for its PCC_FD requests */
+ssize_t recv_input(struct pcc_conn* conn, char* buf, size_t len) {
+    char control[CMSG_SPACE(sizeof(int) * 16)];
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    ssize_t bytes_read = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+
+    if(bytes_read < 0)
+        return bytes_read;
+    for(struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)){
+        if(cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+            continue;
+        for(size_t i = 0; i < (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++){
+            int fd;
+            memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            pcc_conn_pass_fd(conn, fd);
+        }
+    }
+    if(msg.msg_flags & MSG_CTRUNC) /* the kernel closed the rest, their requests won't be answered right */
+        fprintf(stderr, "Error: client passed too many files at once\n");
+    return bytes_read;
+}
 
-    uint16_t server_port; /* argv[1] - server's port number - 16-bit unsigned integer*/
-    int listen_socket; /* socket for listening */
-    struct sockaddr_in serv_addr; /* server's address - saw in TIRGUL*/
+/*
+* the replies in conn's out[] went through completely: add their counts to the worker's shard.
+* Only the shard's own worker gets here, the seqlock just keeps pcc_shard_read() from seeing half of it
+*/
+void pcc_commit(struct pcc_shard* shard, struct pcc_conn* conn) {
+    uint64_t seq = shard->seq;
+    if(conn->unsent_requests == 0)
+        return;
+    __atomic_store_n(&shard->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); /* odd seq is visible before any count changes */
+    for(int i = 0; i < PCC_NCHARS; i++) {
+        __atomic_store_n(&shard->count[i], shard->count[i] + conn->unsent[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&shard->requests, shard->requests + conn->unsent_requests, __ATOMIC_RELAXED);
+    if (conn->x != NULL) { /* under the same seqlock */
+        struct pcc_xcounts* x = &xshards[shard - shards];
+        for(int b = 0; b < 256; b++)
+            __atomic_store_n(&x->bytes[b], x->bytes[b] + conn->x->unsent.bytes[b], __ATOMIC_RELAXED);
+        for(int i = 0; i < PCC_NCHARS * PCC_NCHARS; i++)
+            __atomic_store_n(&x->pairs[i], x->pairs[i] + conn->x->unsent.pairs[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&shard->seq, seq + 2, __ATOMIC_RELEASE);
+    pcc_statsfile_add(conn->unsent, conn->unsent_requests);
+    memset(conn->unsent, 0, sizeof(conn->unsent));
+    if (conn->x != NULL)
+        memset(&conn->x->unsent, 0, sizeof(conn->x->unsent));
+    conn->unsent_requests = 0;
+}
+
+/*
+* serve one connection: read N, read the N bytes counting printable chars into conn, send back C
+* (for every request of a v2 connection), committing the counts of each request once its C was sent.
+* returns 1 if the connection failed (the counts not committed yet are discarded), 0 otherwise
+*/
+int handle_client(struct pcc_shard* shard, int socket_fd, struct pcc_conn* conn) {
+    char read_buffer[100000]; /* buffer for reading 100KB char each time to add it (or not) to the stats */
+    ssize_t bytes_read;
+    size_t want;
+    int done;
+
+    pcc_conn_reset(conn, socket_fd);
+    while(1){
+        if(conn->out_off < conn->out_len){ /* write the printable_char_count(s) to the client */
+            if(send_C(socket_fd, conn->out + conn->out_off, conn->out_len - conn->out_off) != 0)
+                return 1;
+            pcc_commit(shard, conn);
+            done = pcc_conn_sent(conn);
+            if(done != 0)
+                return done < 0;
+            continue;
+        }
+        if(conn->state == PCC_BODY && pipeline_counters > 0 && conn->remaining >= pipeline_min){
+            if(pcc_pipeline_body(conn) != 0)
+                return 1;
+            continue;
+        }
+        want = pcc_conn_want(conn); /* never read past a v1 request */
+        bytes_read = recv_input(conn, read_buffer, want < sizeof(read_buffer) ? want : sizeof(read_buffer));
+        if(bytes_read < 0){
+            if(errno == EINTR)
+                continue;
+            int err = errno; /* perror() may change errno */
+            perror("Error: failed reading from client: ");
+            if(is_client_error(err))
+                return 1;
+            exit(1);
+        }
+        if(bytes_read == 0){ /* client closed its side: fine only between two v2 requests */
+            done = pcc_conn_eof(conn);
+            if(done != 0)
+                return done < 0;
+            continue;
+        }
+        pcc_conn_feed(conn, read_buffer, bytes_read);
+        if(conn->failed)
+            return 1;
+    }
+}
+
+/*
+* accept connections on listen_fd one at a time and serve them, their stats go to shard as their replies are sent.
+* With a stop_fd, listen_fd is non-blocking and the loop waits for either; otherwise it is shut down to stop us
+*/
+void* accept_loop(struct pcc_shard* shard, int listen_fd, int stop_fd) {
+    struct pcc_conn conn;
     int socket_fd; /* socket after accepting connection */
-    struct sockaddr_in peer_addr; /* client's address - saw in TIRGUL*/
-    char read_buffer[100000]; /* buffer for reading 100KB char each time to add it (or not) to pcc_total */
-    int bytes_read; 
-    char* readn_buffer; /* buffer for reading N */
-    int total_read;
-    int not_ridden;
-    uint64_t N;
-    uint64_t printable_char_count; /* how many printable chars seen in this connection */
-    int client_error;
-    uint64_t pcc_client[95];
-    uint64_t c_network; /* network byte order */
-
-    is_processing_client = 0;
-    called_sigint_when_busy = 0;
-    for(int i = 0; i < 95; i++) { /* reset pcc_total */
-        pcc_total[i] = 0;
-    }
-
-    update_sigint_handler(); 
-    
+    struct pollfd pfds[2] = {{.fd = listen_fd, .events = POLLIN}, {.fd = stop_fd, .events = POLLIN}};
+
+    while(1){
+        if (stop_fd >= 0 && (poll(pfds, 2, -1) < 0 || (pfds[1].revents & POLLIN))) {
+            if(pfds[1].revents & POLLIN)
+                break;
+            continue; /* EINTR */
+        }
+        socket_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC); /* blocking: the worker reads it that way */
+        if (socket_fd < 0) {
+            if(stopping) /* the listening socket was shut down */
+                break;
+            if(errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) /* EAGAIN: another worker got it */
+                continue;
+            perror("Error: failed accepting connection: ");
+            exit(1);
+        }
+        if(client_timeout_ms > 0){ /* reads and writes fail with EAGAIN once the client stalls that long */
+            struct timeval tv = {.tv_sec = client_timeout_ms / 1000, .tv_usec = client_timeout_ms % 1000 * 1000};
+            setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        }
+        handle_client(shard, socket_fd, &conn); /* the stats are updated only for requests answered without error */
+        pcc_conn_free(&conn);
+        close(socket_fd);
+        if(stopping) /* SIGINT while busy: don't take another request */
+            break;
+    }
+    return NULL;
+}
+
+/* worker thread */
+void* worker(void* arg) {
+    return accept_loop(arg, listen_socket, -1);
+}
+
+/*
+* -l: worker thread for the UNIX socket, in every mode. -k processes share that socket, so shutting it down
+* would stop them all: each process stops its own unix workers through unix_stop_fd instead
+*/
+void* unix_worker(void* arg) {
+    return accept_loop(arg, unix_socket, unix_stop_fd);
+}
+
+/*
+* the listening socket on server_port; with reuseport every -k process binds one of its own.
+* With -d the kernel completes handshakes on its own and queues a client only once its first segment
+* (the header, or the v2 hello) is in, so a worker's first read of it never waits; with -q a client that
+* has a Fast Open cookie from an earlier connection sends that segment on the SYN, saving a round trip
+* per connection. Both only apply to TCP; -q also needs net.ipv4.tcp_fastopen to allow servers (bit 2).
+*/
+void open_listen_socket(uint16_t server_port, int event_mode, int reuseport) {
+    struct sockaddr_in serv_addr; /* server's address - saw in TIRGUL*/
     socklen_t addrsize; /* size of the address */
+    struct rlimit nofile;
+
     addrsize = sizeof(struct sockaddr_in);
-    client_error = 0;
-    
-    if (argc != 2) { /* argc has to be 2 (1 real argument) */
-        printf("Error: wrong number of arguments\n");  
-        exit(1);
-    }
-    
-    server_port = atoi(argv[1]);
     listen_socket = socket(AF_INET, SOCK_STREAM, 0); /* create a TCP listening socket: AF_INET(IPV4), SOCK_STREAM(TCP) */
     if (listen_socket < 0) {
         perror("Error: failed creating listening socket: ");
@@ -119,7 +275,13 @@ int main(int argc, char *argv[]){
         perror("Error: failed to set socket option SO_REUSEADDR: ");
         exit(1);
     }
+    /* the kernel spreads new connections over every socket bound to the port */
+    if (reuseport && setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0){
+        perror("Error: failed to set socket option SO_REUSEPORT: ");
+        exit(1);
+    }
 
+    memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = htonl(INADDR_ANY); /* INADDR_ANY = any local machine address */
     serv_addr.sin_port = htons(server_port); /* convert port number from host byte order to network byte order */
@@ -128,128 +290,364 @@ int main(int argc, char *argv[]){
         exit(1);
     }
 
+    if (defer_accept_secs > 0 && setsockopt(listen_socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept_secs, sizeof(int)) < 0){
+        perror("Error: failed to set socket option TCP_DEFER_ACCEPT: ");
+        exit(1);
+    }
+    if (fastopen_queue > 0 && setsockopt(listen_socket, IPPROTO_TCP, TCP_FASTOPEN, &fastopen_queue, sizeof(int)) < 0){
+        perror("Error: failed to set socket option TCP_FASTOPEN: ");
+        exit(1);
+    }
+
     /* Listen to incoming TCP connections on the erver port */
-    if (listen(listen_socket, 10) < 0) { /* queue of size 10 connections */
+    if (listen_backlog < 0) /* queue of size 10 connections, more for thousands of clients */
+        listen_backlog = event_mode ? SOMAXCONN : 10;
+    if (listen(listen_socket, listen_backlog) < 0) { /* the kernel caps it at net.core.somaxconn */
         perror("Error: failed listening on listening socket: ");
         exit(1);
     }
 
-    /* Enter a loop, in which each iteration: */
-    while(1){
-        for(int i = 0; i < 95; i++) { /* reset pcc_client */
-            pcc_client[i] = 0;
+    if (event_mode) {
+        /* several loops share the listening socket, whoever loses the race must not block in accept */
+        if (fcntl(listen_socket, F_SETFL, O_NONBLOCK) < 0 || (stop_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+            perror("Error: failed setting up event mode: ");
+            exit(1);
         }
-        client_error = 0;
-        if(called_sigint_when_busy == 1) { /* if not processing client's request */
-            for(int i = 0; i < 95; i++) { /* print pcc_total */
-                printf("char '%c' : %lu times\n", (i+32), pcc_total[i]);
-            }
-            exit(0);
+        /* one descriptor per connection: allow as many as the hard limit does */
+        if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+            nofile.rlim_cur = nofile.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &nofile);
         }
+    }
+}
 
-        is_processing_client = 0; /* we are not processing client's request yet */
-        printable_char_count = 0; /* reset printable_char_count for this connection */
-        socket_fd = accept(listen_socket, (struct sockaddr*) &peer_addr, &addrsize); /* accept a connection */
-        if (socket_fd < 0) {
-            perror("Error: failed accepting connection: ");
+/* -l: the UNIX socket at path, replacing a stale one; created once, -k processes share it */
+void open_unix_socket(const char* path) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: UNIX socket path too long\n");
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unix_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0); /* several workers poll it */
+    if (unix_socket < 0) {
+        perror("Error: failed creating UNIX socket: ");
+        exit(1);
+    }
+    unlink(path);
+    if (bind(unix_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(unix_socket, SOMAXCONN) < 0) {
+        perror("Error: failed binding UNIX socket: ");
+        exit(1);
+    }
+}
+
+/*
+* run num_workers workers on listen_socket and unix_workers on unix_socket, counting into
+* shards[0..num_workers + unix_workers), until SIGINT stopped them all
+*/
+void serve(int event_mode, sigset_t* sigint_set) {
+    pthread_t* threads;
+    int sig;
+
+    threads = malloc(sizeof(pthread_t) * (num_workers + unix_workers));
+    if (threads == NULL) {
+        perror("Error: failed allocating workers: ");
+        exit(1);
+    }
+    for(int w = 0; w < num_workers; w++){
+        if (pthread_create(&threads[w], NULL, event_mode == 2 ? uring_loop : event_mode ? event_loop : worker, &shards[w]) != 0) {
+            perror("Error: failed creating worker thread: ");
             exit(1);
         }
-
-        is_processing_client = 1; /* we are processing client's request now */
-        /* read N from client */
-        readn_buffer = (char*)malloc(sizeof(uint64_t));
-        if(readn_buffer == NULL){
-            perror("Error: failed allocating memory for readn_buffer: ");
+    }
+    if (unix_workers > 0 && (unix_stop_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        perror("Error: failed setting up UNIX socket workers: ");
+        exit(1);
+    }
+    for(int w = num_workers; w < num_workers + unix_workers; w++){
+        if (pthread_create(&threads[w], NULL, unix_worker, &shards[w]) != 0) {
+            perror("Error: failed creating worker thread: ");
             exit(1);
         }
-        memset(readn_buffer, 0, sizeof(uint64_t)); /* reset the buffer */
-        total_read = 0;
-        not_ridden = 8; /* 8 bytes to read - N is 8 bytes */
-        while(not_ridden > 0){ /* while there are still bytes to read */
-            bytes_read = read(socket_fd, readn_buffer + total_read, not_ridden);
-            if(bytes_read < 0){
-                perror("Error: failed reading N from client: ");
-                if((errno == ETIMEDOUT) || (errno == ECONNRESET) || (errno == EPIPE) || (errno == EOF))
-                {
-                    client_error = 1;
-                } 
-                else
-                {
-                    exit(1);
-                }
-            }
-            total_read += bytes_read;
-            not_ridden -= bytes_read;
-        }
-        N = be64toh(*(uint64_t*)readn_buffer); /* N is 8 bytes and adjust endians */
-        /* read N bytes from client - read the file */
-        total_read = 0;
-        not_ridden = N; /* N bytes to read */
-        while(not_ridden > 0){
-            bytes_read = read(socket_fd, read_buffer, 100000); /* read 100000 char */        
-            if(bytes_read < 0){
-                perror("Error: failed reading from client: ");
-                if((errno == ETIMEDOUT) || (errno == ECONNRESET) || (errno == EPIPE) || (errno == EOF))
-                {
-                    client_error = 1;
-                } 
-                else
-                {
+    }
+
+    /* wait for SIGINT, then let every worker finish its current client */
+    while (sigwait(sigint_set, &sig) != 0)
+        ;
+    stopping = 1;
+    if (event_mode)
+        eventfd_write(stop_fd, 1); /* wakes every event loop */
+    else
+        shutdown(listen_socket, SHUT_RDWR); /* wakes the workers blocked in accept() */
+    if (unix_workers > 0)
+        eventfd_write(unix_stop_fd, 1); /* level-triggered, every unix worker sees it */
+    for(int w = 0; w < num_workers + unix_workers; w++){
+        pthread_join(threads[w], NULL);
+    }
+    free(threads);
+}
+
+/* -k: process k of prefork(), serving with its own listening socket and its own shards */
+pid_t spawn(int k, uint16_t server_port, int event_mode, sigset_t* sigint_set) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Error: failed forking server process: ");
+        exit(1);
+    }
+    if (pid > 0)
+        return pid;
+    prctl(PR_SET_PDEATHSIG, SIGINT); /* the parent is gone: stop as if it had told us to */
+    if (getppid() != parent) /* ... already, before prctl() */
+        exit(0);
+    shards += k * (num_workers + unix_workers);
+    if (xshards != NULL)
+        xshards += k * (num_workers + unix_workers);
+    open_listen_socket(server_port, event_mode, 1);
+    serve(event_mode, sigint_set);
+    exit(0);
+}
+
+/*
+* -k: the server is num_procs processes, each with its own listening socket on the port (SO_REUSEPORT,
+* the kernel balances the connections) and num_workers workers whose shards are slots of one shared
+* mapping, so the parent can read them all. A process killed by a signal is replaced and its shards keep
+* what it committed (if it died inside pcc_commit() the half-added counts stay). The parent serves the
+* control socket, and on SIGINT tells every process to stop and waits for them; then the shards are final.
+*/
+void prefork(int num_procs, uint16_t server_port, int event_mode, sigset_t* sigint_set) {
+    pid_t* pids = calloc(num_procs, sizeof(pid_t));
+    sigset_t parent_set = *sigint_set;
+    pid_t pid;
+    int sig, status;
+
+    sigaddset(&parent_set, SIGCHLD); /* blocked: it stays pending for sigwait() */
+    if (pids == NULL || pthread_sigmask(SIG_BLOCK, &parent_set, NULL) != 0) {
+        perror("Error: failed setting up processes: ");
+        exit(1);
+    }
+    for(int k = 0; k < num_procs; k++)
+        pids[k] = spawn(k, server_port, event_mode, sigint_set);
+    if (control_path != NULL) /* threads only after the forks */
+        control_start();
+
+    while(1){
+        while (sigwait(&parent_set, &sig) != 0)
+            ;
+        if (sig == SIGINT)
+            break;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for(int k = 0; k < num_procs; k++){
+                if (pids[k] != pid)
+                    continue;
+                pids[k] = 0;
+                if (WIFEXITED(status) && WEXITSTATUS(status) == 0) /* SIGINT came to it first (terminal) */
+                    break;
+                if (WIFEXITED(status)) { /* a fatal error would only repeat */
+                    fprintf(stderr, "Error: server process %d failed\n", pid);
                     exit(1);
                 }
-            }
-
-           /* update pcc_client */
-            for(int i = 0; i < bytes_read; i++){ /* for each char in the read_buffer */
-                if((32 <= read_buffer[i]) && (read_buffer[i] <= 126)){ /* if the char is printable */
-                    pcc_client[(int)(read_buffer[i]-32)]++; /* add it to pcc_client */
-                    printable_char_count++; /* add to this connection printable char count */
+                fprintf(stderr, "Error: server process %d killed by signal %d, restarting it\n", pid, WTERMSIG(status));
+                for(int w = k * (num_workers + unix_workers); w < (k + 1) * (num_workers + unix_workers); w++){
+                    if (shards[w].seq & 1) /* died inside a commit: let readers in again */
+                        shards[w].seq++;
                 }
-            }
-            not_ridden = not_ridden - bytes_read; /* update not_ridden */
-            total_read = total_read + bytes_read; /* update total_read */
-        }
-        /* write the printable_char_count to the client */
-        c_network = htobe64(printable_char_count);
-
-        if (send_C(socket_fd, &c_network) == 1) /* send C */
-            client_error = 1;
-        
-        /* update pcc_total only if no error in client */
-        if(client_error == 0){
-            for(int i = 0; i < 95; i++) {
-                pcc_total[i] += pcc_client[i];
+                pids[k] = spawn(k, server_port, event_mode, sigint_set);
             }
         }
-        
     }
+    stopping = 1;
+    for(int k = 0; k < num_procs; k++){
+        if (pids[k] > 0)
+            kill(pids[k], SIGINT);
+    }
+    for(int k = 0; k < num_procs; k++){
+        if (pids[k] > 0)
+            waitpid(pids[k], NULL, 0);
+    }
+    if (control_path != NULL)
+        control_stop();
+    free(pids);
 }
 
+void print_stats() {
+    for(int i = 0; i < PCC_NCHARS; i++) { /* print pcc_total */
+        printf("char '%c' : %lu times\n", (i+32), pcc_total[i]);
+    }
+    if (xshards == NULL)
+        return;
+    for(int b = 0; b < 256; b++) { /* -x: pcc_xtotal, every pair that was seen */
+        printf("byte 0x%02x : %lu times\n", b, pcc_xtotal.bytes[b]);
+    }
+    for(int i = 0; i < PCC_NCHARS * PCC_NCHARS; i++) {
+        if (pcc_xtotal.pairs[i] > 0)
+            printf("pair '%c%c' : %lu times\n", i / PCC_NCHARS + 32, i % PCC_NCHARS + 32, pcc_xtotal.pairs[i]);
+    }
+}
 
 
+int main(int argc, char *argv[]){
 
+    uint16_t server_port; /* argv[1] - server's port number - 16-bit unsigned integer*/
+    sigset_t sigint_set;
+    int opt;
+    int event_mode = 0; /* 1 for -e, 2 for -u */
+    const char* stats_path = NULL; /* -f */
+    int num_procs = 0; /* -k, 0: this process serves */
+    const char* unix_path = NULL; /* -l */
+    int measure_counters = 0; /* -g */
+
+    num_workers = 1;
+    while((opt = getopt(argc, argv, "t:euc:p:s:f:n:k:l:ai:xb:d:q:m:g")) != -1){
+        if(opt == 't' && atoi(optarg) > 0){
+            num_workers = atoi(optarg);
+        }
+        else if(opt == 'e'){
+            event_mode = 1;
+        }
+        else if(opt == 'u'){
+            event_mode = 2;
+        }
+        else if(opt == 'c' && atoi(optarg) > 0){
+            max_conns = atoi(optarg);
+        }
+        else if(opt == 'p' && atoi(optarg) > 0){
+            pipeline_counters = atoi(optarg);
+        }
+        else if(opt == 's'){
+            control_path = optarg;
+        }
+        else if(opt == 'f'){
+            stats_path = optarg;
+        }
+        else if(opt == 'n' && atoi(optarg) >= 0){
+            statsfile_sync_every = atoi(optarg);
+        }
+        else if(opt == 'k' && atoi(optarg) > 0){
+            num_procs = atoi(optarg);
+        }
+        else if(opt == 'l'){
+            unix_path = optarg;
+        }
+        else if(opt == 'a'){
+            pcc_accept_hist = 1;
+        }
+        else if(opt == 'i' && atoi(optarg) >= 0){
+            client_timeout_ms = atoi(optarg);
+        }
+        else if(opt == 'x'){
+            pcc_analytics = 1;
+        }
+        else if(opt == 'b' && atoi(optarg) > 0){
+            listen_backlog = atoi(optarg);
+        }
+        else if(opt == 'd' && atoi(optarg) >= 0){
+            defer_accept_secs = atoi(optarg);
+        }
+        else if(opt == 'q' && atoi(optarg) >= 0){
+            fastopen_queue = atoi(optarg);
+        }
+        else if(opt == 'm' && atoi(optarg) >= 0){
+            accept_batch = atoi(optarg);
+        }
+        else if(opt == 'g'){
+            measure_counters = 1;
+        }
+        else{
+            printf("Error: usage: %s <port> [-t threads] [-e | -u] [-c max_connections] [-p counters] [-s control_socket] [-f stats_file [-n fsync_every]] [-k processes] [-l unix_socket] [-a] [-i timeout_ms] [-x] [-b backlog] [-d defer_secs] [-q fastopen_queue] [-m accept_batch] [-g]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1) { /* exactly 1 real argument besides the options */
+        printf("Error: wrong number of arguments\n");
+        exit(1);
+    }
+    if (num_procs > 0 && stats_path != NULL) { /* the file is written by one process only */
+        printf("Error: -f can't be used with -k\n");
+        exit(1);
+    }
+    if (pcc_analytics && pipeline_counters > 0) { /* the counting threads only know the 95 bins */
+        printf("Error: -x can't be used with -p\n");
+        exit(1);
+    }
+    server_port = atoi(argv[optind]);
+
+    /* the counting kernel, before any worker counts (and before -k forks, so every process uses the same) */
+    if (measure_counters)
+        fprintf(stderr, "counting with %s (measured)\n", pcc_count_init(1));
+    else
+        pcc_count_init(0);
+
+    /*
+    * SIGINT is only ever taken by the main thread through sigwait(): workers always finish the client they
+    * are serving, and the stats are printed once all of them have stopped.
+    */
+    sigemptyset(&sigint_set);
+    sigaddset(&sigint_set, SIGINT);
+    if (pthread_sigmask(SIG_BLOCK, &sigint_set, NULL) != 0) {
+        perror("Error: failed blocking SIGINT: ");
+        exit(1);
+    }
 
+    if (stats_path != NULL) /* pcc_total starts from the last run's totals */
+        pcc_statsfile_open(stats_path, pcc_restored, &pcc_restored_requests);
+    memcpy(pcc_total, pcc_restored, sizeof(pcc_total));
 
+    /* every worker gets its own zeroed shard; with -k they are shared with the parent */
+    if (unix_path != NULL) {
+        open_unix_socket(unix_path);
+        unix_workers = num_workers;
+    }
+    num_shards = (num_workers + unix_workers) * (num_procs > 0 ? num_procs : 1);
+    if (num_procs > 0)
+        shards = mmap(NULL, sizeof(struct pcc_shard) * num_shards, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    else
+        shards = aligned_alloc(64, sizeof(struct pcc_shard) * num_shards);
+    if (shards == NULL || shards == MAP_FAILED) {
+        perror("Error: failed allocating workers: ");
+        exit(1);
+    }
+    memset(shards, 0, sizeof(struct pcc_shard) * num_shards);
+    if (pcc_analytics) {
+        if (num_procs > 0)
+            xshards = mmap(NULL, sizeof(struct pcc_xcounts) * num_shards, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        else
+            xshards = aligned_alloc(64, sizeof(struct pcc_xcounts) * num_shards);
+        if (xshards == NULL || xshards == MAP_FAILED) {
+            perror("Error: failed allocating workers: ");
+            exit(1);
+        }
+        memset(xshards, 0, sizeof(struct pcc_xcounts) * num_shards);
+    }
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
+    if (num_procs > 0) {
+        prefork(num_procs, server_port, event_mode, &sigint_set);
+    }
+    else {
+        open_listen_socket(server_port, event_mode, 0);
+        if (control_path != NULL)
+            control_start();
+        serve(event_mode, &sigint_set);
+        if (control_path != NULL) /* no more queries, the final stats are printed below */
+            control_stop();
+    }
+    for(int w = 0; w < num_shards; w++){
+        for(int i = 0; i < PCC_NCHARS; i++) { /* merge every worker's shard into pcc_total */
+            pcc_total[i] += shards[w].count[i];
+        }
+        if (xshards == NULL)
+            continue;
+        for(int b = 0; b < 256; b++)
+            pcc_xtotal.bytes[b] += xshards[w].bytes[b];
+        for(int i = 0; i < PCC_NCHARS * PCC_NCHARS; i++)
+            pcc_xtotal.pairs[i] += xshards[w].pairs[i];
+    }
+    pcc_statsfile_close();
+    if (unix_path != NULL)
+        unlink(unix_path);
+    print_stats();
+    exit(0);
+}
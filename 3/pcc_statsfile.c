@@ -0,0 +1,137 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include "pcc.h"
+
+/*
+* Persistent stats file (pcc_server -f, server -f): the totals so far, memory-mapped and updated on
+* every commit, so they survive a restart. The file holds two slots; a commit writes the new totals,
+* one generation higher, into the slot that is not the latest, and seals it with a checksum. A crash
+* (or a power loss before the pages reached the disk) can only tear the slot being written, and on
+* startup the valid slot with the highest generation wins, so counts are never half updated: at worst
+* the last commits are lost. The file is msync'ed every statsfile_sync_every commits (0: only when the
+* server stops; the kernel still writes it back on its own, and a killed process loses nothing).
+* The layout is in host byte order, for the host that wrote it.
+*/
+
+#define STATSFILE_MAGIC "PCCSTAT1"
+
+struct statsfile_slot {
+    uint64_t generation; /* 0: never written */
+    uint64_t requests;
+    uint64_t count[PCC_NCHARS];
+    uint64_t check; /* over everything above */
+};
+
+struct statsfile_image {
+    char magic[8];
+    struct statsfile_slot slot[2]; /* generation g lives in slot[g & 1] */
+};
+
+int statsfile_sync_every = 0;
+static struct statsfile_image* image; /* NULL: no stats file */
+static struct statsfile_slot* latest;
+static uint64_t unsynced; /* commits since the last msync */
+static pthread_mutex_t statsfile_lock = PTHREAD_MUTEX_INITIALIZER; /* workers commit concurrently */
+
+
+static uint64_t slot_check(const struct statsfile_slot* slot) {
+    const uint64_t* word = (const uint64_t*)slot;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < offsetof(struct statsfile_slot, check) / sizeof(uint64_t); i++){
+        h ^= word[i];
+        h *= 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+static int slot_valid(const struct statsfile_slot* slot) {
+    return slot->generation != 0 && slot->check == slot_check(slot);
+}
+
+/* map path (creating it if needed) and add the totals it holds into counts and requests */
+void pcc_statsfile_open(const char* path, uint64_t* counts, uint64_t* requests) {
+    struct stat st;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if(fd < 0 || fstat(fd, &st) < 0){
+        perror("Error: failed opening stats file: ");
+        exit(1);
+    }
+    if(st.st_size == 0 && ftruncate(fd, sizeof(struct statsfile_image)) < 0){ /* new file: zeroed slots */
+        perror("Error: failed creating stats file: ");
+        exit(1);
+    }
+    else if(st.st_size != 0 && st.st_size != sizeof(struct statsfile_image)){
+        fprintf(stderr, "Error: %s is not a stats file\n", path);
+        exit(1);
+    }
+    image = mmap(NULL, sizeof(struct statsfile_image), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(image == MAP_FAILED){
+        perror("Error: failed mapping stats file: ");
+        exit(1);
+    }
+    close(fd); /* the mapping keeps it */
+    if(st.st_size == 0)
+        memcpy(image->magic, STATSFILE_MAGIC, sizeof(image->magic));
+    else if(memcmp(image->magic, STATSFILE_MAGIC, sizeof(image->magic)) != 0){
+        fprintf(stderr, "Error: %s is not a stats file\n", path);
+        exit(1);
+    }
+
+    latest = &image->slot[0]; /* generation 0 when neither slot is valid: start from zero */
+    if(!slot_valid(latest))
+        memset(latest, 0, sizeof(*latest));
+    if(slot_valid(&image->slot[1]) && image->slot[1].generation > latest->generation)
+        latest = &image->slot[1];
+    for(int i = 0; i < PCC_NCHARS; i++)
+        counts[i] += latest->count[i];
+    *requests += latest->requests;
+}
+
+/*
+* add one commit's counts to the file (no-op without a stats file). The msync every statsfile_sync_every
+* commits happens after the lock is released, so the other workers' commits don't queue behind the disk;
+* a slot being written meanwhile may reach the disk torn, but the one sealed before it stays valid.
+*/
+void pcc_statsfile_add(const uint64_t* counts, uint64_t requests) {
+    struct statsfile_slot* next;
+    int sync_now = 0;
+
+    if(image == NULL)
+        return;
+    pthread_mutex_lock(&statsfile_lock);
+    next = &image->slot[(latest->generation + 1) & 1];
+    next->generation = 0; /* invalid until sealed */
+    for(int i = 0; i < PCC_NCHARS; i++)
+        next->count[i] = latest->count[i] + counts[i];
+    next->requests = latest->requests + requests;
+    next->generation = latest->generation + 1;
+    next->check = slot_check(next);
+    latest = next;
+    if(statsfile_sync_every > 0 && ++unsynced >= (uint64_t)statsfile_sync_every){
+        unsynced = 0;
+        sync_now = 1;
+    }
+    pthread_mutex_unlock(&statsfile_lock);
+    if(sync_now && msync(image, sizeof(struct statsfile_image), MS_SYNC) < 0)
+        perror("Error: failed syncing stats file: ");
+}
+
+/* the server stops: write the file back */
+void pcc_statsfile_close(void) {
+    if(image == NULL)
+        return;
+    if(msync(image, sizeof(struct statsfile_image), MS_SYNC) < 0)
+        perror("Error: failed syncing stats file: ");
+    munmap(image, sizeof(struct statsfile_image));
+    image = NULL;
+}
@@ -0,0 +1,142 @@
+#include <time.h>
+#include "pcc.h"
+
+/*
+* Client deadlines (-i timeout_ms): a connection that takes longer than that to send a header, to make
+* progress in its body or to take its replies is dropped as a client error, and the counts of its
+* requests not answered yet are discarded. The blocking workers leave it to the socket
+* (SO_RCVTIMEO / SO_SNDTIMEO); the event loops keep one timer per connection in a hierarchical timer
+* wheel, armed by pcc_conn_deadline() after every event, so arming and cancelling is a list insert and
+* unlink whatever the number of connections. PCC_WHEEL_LEVELS wheels of PCC_WHEEL_SLOTS slots cover timeouts of up to
+* 64^4 ticks of PCC_TICK_MS; a timer lands in the finest wheel its expiry fits and moves down a level
+* every time the finer wheel comes round. A loop checks its deadlines after every batch of events.
+*/
+
+int client_timeout_ms = 30000; /* 0: no deadlines */
+
+
+static void timer_unlink(struct pcc_timer* t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+/* the slot for t's expiry (not before now): the finest level in which it is less than a full turn ahead of now */
+static void timer_insert(struct pcc_wheel* w, struct pcc_timer* t) {
+    struct pcc_timer* head;
+    int level = 0;
+
+    while(level < PCC_WHEEL_LEVELS - 1 &&
+          (t->expires >> (PCC_WHEEL_BITS * level)) - (w->now >> (PCC_WHEEL_BITS * level)) >= PCC_WHEEL_SLOTS)
+        level++;
+    if((t->expires >> (PCC_WHEEL_BITS * level)) - (w->now >> (PCC_WHEEL_BITS * level)) >= PCC_WHEEL_SLOTS) /* beyond the wheel */
+        t->expires = ((w->now >> (PCC_WHEEL_BITS * level)) + PCC_WHEEL_SLOTS - 1) << (PCC_WHEEL_BITS * level);
+    head = &w->slots[level][(t->expires >> (PCC_WHEEL_BITS * level)) & (PCC_WHEEL_SLOTS - 1)];
+    t->next = head->next;
+    t->prev = head;
+    head->next->prev = t;
+    head->next = t;
+}
+
+/* current time in ticks */
+uint64_t pcc_ticks(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / PCC_TICK_MS;
+}
+
+/* an empty wheel at the current time */
+void pcc_wheel_init(struct pcc_wheel* w) {
+    for(int level = 0; level < PCC_WHEEL_LEVELS; level++)
+        for(int i = 0; i < PCC_WHEEL_SLOTS; i++)
+            w->slots[level][i].next = w->slots[level][i].prev = &w->slots[level][i];
+    w->now = pcc_ticks();
+    w->armed = 0;
+}
+
+/* (re)start t to expire client_timeout_ms from now; no-op without deadlines */
+void pcc_timer_arm(struct pcc_wheel* w, struct pcc_timer* t) {
+    uint64_t now;
+
+    if(client_timeout_ms <= 0)
+        return;
+    pcc_timer_cancel(w, t);
+    /* an empty wheel isn't ticked, the loop may have slept for long: catch up, or t would be due already */
+    if(w->armed == 0 && (now = pcc_ticks()) > w->now)
+        w->now = now;
+    t->expires = w->now + (client_timeout_ms + PCC_TICK_MS - 1) / PCC_TICK_MS; /* at least the next tick */
+    timer_insert(w, t);
+    w->armed++;
+}
+
+/* stop t if it is armed */
+void pcc_timer_cancel(struct pcc_wheel* w, struct pcc_timer* t) {
+    if(t->next == NULL)
+        return;
+    timer_unlink(t);
+    w->armed--;
+}
+
+/*
+* after a loop handled a connection's events: arm its deadline for what the connection waits for now.
+* The header (the first one, or the next between v2 requests) and taking the replies each get one
+* deadline that bytes trickling in or out don't extend; in the body it restarts only once another
+* PCC_PROGRESS_BYTES arrived, so a client sending a byte at a time can't hold the connection. Every
+* request answered starts it again too: an epoll loop may go from one header to the next in one event.
+*/
+void pcc_conn_deadline(struct pcc_wheel* w, struct pcc_conn* conn) {
+    enum pcc_wait waiting = PCC_WAIT_HEADER;
+
+    if(conn->out_off < conn->out_len)
+        waiting = PCC_WAIT_REPLY;
+    else if(conn->state == PCC_BODY || conn->state == PCC_COUNTS)
+        waiting = PCC_WAIT_BODY;
+    if(waiting == conn->waiting && conn->queued == conn->queued_armed &&
+       (waiting != PCC_WAIT_BODY || conn->received - conn->received_armed < PCC_PROGRESS_BYTES))
+        return;
+    conn->waiting = waiting;
+    conn->received_armed = conn->received;
+    conn->queued_armed = conn->queued;
+    pcc_timer_arm(w, &conn->timer);
+}
+
+/* move the wheel up to the tick now, calling expire(t, arg) for every timer that ran out on the way */
+void pcc_wheel_advance(struct pcc_wheel* w, uint64_t now, void (*expire)(struct pcc_timer* t, void* arg), void* arg) {
+    struct pcc_timer due;
+
+    if(w->armed == 0){ /* nothing to go through */
+        if(now > w->now)
+            w->now = now;
+        return;
+    }
+    while(w->now < now){
+        w->now++;
+        /* a finer wheel came round: spread the next slot of the coarser one over the finer ones */
+        for(int level = 1; level < PCC_WHEEL_LEVELS; level++){
+            struct pcc_timer* head;
+            if((w->now >> (PCC_WHEEL_BITS * (level - 1))) & (PCC_WHEEL_SLOTS - 1))
+                break;
+            head = &w->slots[level][(w->now >> (PCC_WHEEL_BITS * level)) & (PCC_WHEEL_SLOTS - 1)];
+            while(head->next != head){
+                struct pcc_timer* t = head->next;
+                timer_unlink(t);
+                timer_insert(w, t);
+            }
+        }
+        /* whatever is in this tick's slot expires now; taken off the wheel first, expire() may arm and cancel */
+        struct pcc_timer* head = &w->slots[0][w->now & (PCC_WHEEL_SLOTS - 1)];
+        if(head->next == head)
+            continue;
+        due.next = head->next;
+        due.prev = head->prev;
+        due.next->prev = &due;
+        due.prev->next = &due;
+        head->next = head->prev = head;
+        while(due.next != &due){
+            struct pcc_timer* t = due.next;
+            timer_unlink(t);
+            w->armed--;
+            expire(t, arg);
+        }
+    }
+}
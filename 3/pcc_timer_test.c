@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pcc.h"
+
+/*
+* Checks of the timer wheel: a timer armed after the wheel sat empty for longer than the timeout (an event
+* loop asleep in epoll_wait() with no client) gets its full timeout, and randomized arms, re-arms and
+* cancels with timeouts on every level of the wheel each expire exactly on their tick. Exits 1 on the
+* first timer that doesn't. Also checks pcc_conn_deadline(): a client trickling its header, its body or
+* taking its reply a byte at a time is dropped one timeout after that deadline was armed, and a body
+* that keeps coming or v2 requests answered one after the other are not.
+*
+* gcc -O2 -Wall -std=gnu11 -o pcc_timer_test pcc_timer_test.c pcc_timer.c
+* ./pcc_timer_test [iterations] [seed]
+*/
+
+#define NTIMERS 5000
+
+static struct pcc_timer timers[NTIMERS];
+static uint64_t due[NTIMERS]; /* tick each armed timer must expire on */
+static uint64_t tick; /* the wheel is being advanced to */
+
+static void expired(struct pcc_timer* t, void* arg) {
+    int i = t - timers;
+    (void)arg;
+    if(due[i] != tick){
+        fprintf(stderr, "Error: timer %d expired at tick %lu instead of %lu\n", i, tick, due[i]);
+        exit(1);
+    }
+    due[i] = 0;
+}
+
+/* the loop slept with nothing armed: arming must start from the current time, not the last advance */
+static void test_idle_then_arm(void) {
+    struct pcc_wheel w;
+    uint64_t timeout;
+
+    client_timeout_ms = 500;
+    timeout = client_timeout_ms / PCC_TICK_MS;
+    pcc_wheel_init(&w);
+    w.now -= 10 * timeout; /* last advanced long ago */
+    pcc_timer_arm(&w, &timers[0]);
+    due[0] = w.now + timeout;
+    if(due[0] < pcc_ticks() + timeout){
+        fprintf(stderr, "Error: timer armed on an idle wheel is due %lu ticks early\n", pcc_ticks() + timeout - due[0]);
+        exit(1);
+    }
+    for(tick = w.now + 1; w.armed > 0; tick++) /* only on its own tick */
+        pcc_wheel_advance(&w, tick, expired, NULL);
+}
+
+static uint64_t conn_expired_at;
+
+static void conn_expired(struct pcc_timer* t, void* arg) {
+    (void)t;
+    (void)arg;
+    conn_expired_at = tick;
+}
+
+enum { MOVE_IN, MOVE_OUT, ANSWER };
+
+/*
+* a client that every tick sends per_tick bytes (MOVE_IN), takes per_tick bytes of its replies (MOVE_OUT) or
+* gets per_tick requests answered within one event (ANSWER), conn staying in the state it is in, handled
+* like a loop does: returns the ticks until it was dropped, 0 if it wasn't within limit ticks
+*/
+static uint64_t ticks_to_drop(struct pcc_conn* conn, int move, unsigned per_tick, uint64_t limit) {
+    struct pcc_wheel w;
+    uint64_t start;
+
+    pcc_wheel_init(&w);
+    pcc_conn_deadline(&w, conn);
+    start = w.now;
+    conn_expired_at = 0;
+    for(tick = start + 1; tick <= start + limit; tick++){
+        if(move == MOVE_IN)
+            conn->received += per_tick;
+        else if(move == ANSWER)
+            conn->queued += per_tick;
+        else if(conn->out_off + per_tick < conn->out_len) /* never all of it */
+            conn->out_off += per_tick;
+        pcc_conn_deadline(&w, conn);
+        pcc_wheel_advance(&w, tick, conn_expired, NULL);
+        if(conn_expired_at != 0)
+            return tick - start;
+    }
+    pcc_timer_cancel(&w, &conn->timer);
+    return 0;
+}
+
+/* slowloris: the header, the body and the reply each have their own deadline, trickling doesn't extend it */
+static void test_trickle(void) {
+    struct pcc_conn conn;
+    uint64_t timeout, got;
+
+    client_timeout_ms = 500;
+    timeout = client_timeout_ms / PCC_TICK_MS;
+    memset(&conn, 0, sizeof(conn));
+    conn.state = PCC_HEADER;
+    if((got = ticks_to_drop(&conn, MOVE_IN, 1, 10 * timeout)) != timeout){
+        fprintf(stderr, "Error: client trickling its header dropped after %lu ticks instead of %lu\n", got, timeout);
+        exit(1);
+    }
+    memset(&conn, 0, sizeof(conn));
+    conn.state = PCC_BODY;
+    if((got = ticks_to_drop(&conn, MOVE_IN, PCC_PROGRESS_BYTES / (2 * timeout), 10 * timeout)) != timeout){
+        fprintf(stderr, "Error: client trickling its body dropped after %lu ticks instead of %lu\n", got, timeout);
+        exit(1);
+    }
+    memset(&conn, 0, sizeof(conn));
+    conn.state = PCC_BODY;
+    if((got = ticks_to_drop(&conn, MOVE_IN, PCC_PROGRESS_BYTES / 2, 10 * timeout)) != 0){
+        fprintf(stderr, "Error: client sending its body at full speed dropped after %lu ticks\n", got);
+        exit(1);
+    }
+    memset(&conn, 0, sizeof(conn));
+    conn.state = PCC_REPLY;
+    conn.out_len = sizeof(conn.out);
+    if((got = ticks_to_drop(&conn, MOVE_OUT, 1, 10 * timeout)) != timeout){
+        fprintf(stderr, "Error: client trickling its replies dropped after %lu ticks instead of %lu\n", got, timeout);
+        exit(1);
+    }
+    memset(&conn, 0, sizeof(conn));
+    conn.state = PCC_HEADER;
+    if((got = ticks_to_drop(&conn, ANSWER, 1, 10 * timeout)) != 0){
+        fprintf(stderr, "Error: v2 client getting its requests answered dropped after %lu ticks\n", got);
+        exit(1);
+    }
+}
+
+static void test_random(int iterations) {
+    struct pcc_wheel w;
+
+    pcc_wheel_init(&w);
+    for(int it = 0; it < iterations; it++){
+        int i = random() % NTIMERS;
+        if(random() % 3 < 2){ /* short and long timeouts, up to several turns of the coarser wheels */
+            client_timeout_ms = (1 + random() % (random() % 2 ? 300 : 30000)) * PCC_TICK_MS;
+            pcc_timer_arm(&w, &timers[i]);
+            due[i] = w.now + client_timeout_ms / PCC_TICK_MS;
+        }
+        else{
+            pcc_timer_cancel(&w, &timers[i]);
+            due[i] = 0;
+        }
+        if(random() % 10 == 0)
+            for(int step = random() % 50; step > 0; step--){
+                tick = w.now + 1;
+                pcc_wheel_advance(&w, tick, expired, NULL);
+            }
+    }
+    while(w.armed > 0){
+        tick = w.now + 1;
+        pcc_wheel_advance(&w, tick, expired, NULL);
+    }
+    for(int i = 0; i < NTIMERS; i++)
+        if(due[i] != 0){
+            fprintf(stderr, "Error: timer %d never expired (due at tick %lu)\n", i, due[i]);
+            exit(1);
+        }
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+    unsigned seed = argc > 2 ? atoi(argv[2]) : 1;
+
+    srandom(seed);
+    test_idle_then_arm();
+    printf("%-8s ok\n", "idle");
+    test_trickle();
+    printf("%-8s ok\n", "trickle");
+    test_random(iterations);
+    printf("%-8s ok\n", "random");
+    return 0;
+}
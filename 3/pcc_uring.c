@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include "pcc.h"
+
+/*
+* io_uring mode (-u): like the epoll loops of pcc_epoll.c, but the kernel does the waiting and the copying.
+* Every loop thread owns a ring with one multishot accept on the listening socket and one multishot recv
+* per connection; received data lands in a ring of provided buffers (registered once, recycled as soon as
+* pcc_conn_input() is done with them), so there is no read() per chunk and no buffer per connection.
+* The 8-byte replies are queued as send SQEs while completions are processed and go to the kernel in the
+* same io_uring_enter() that waits for the next batch. No liburing: the rings are mapped by hand.
+* Deadlines are kept in a timer wheel as in pcc_epoll.c, ticked by a timeout request while any is armed.
+* Kernels without io_uring (or older than 6.0, which multishot recv needs) get the epoll loop instead.
+*/
+
+#define RING_ENTRIES 256
+#define CQ_ENTRIES 8192 /* multishot requests post many completions per submission */
+#define NBUFS 64 /* provided buffers, a power of 2 */
+#define BUF_SIZE 16384 /* NBUFS * BUF_SIZE = 1 MB per loop */
+#define BGID 0
+
+/* user_data: what completed in the low byte, the connection's pool slot above it */
+enum { OP_ACCEPT, OP_STOP, OP_RECV, OP_SEND, OP_CANCEL, OP_TICK };
+#define UD(op, slot) ((uint64_t)(op) | ((uint64_t)(slot) << 8))
+
+struct uconn {
+    struct pcc_conn c;
+    char recv_armed; /* a multishot recv is in flight */
+    char sending; /* a send of c.out is in flight */
+    char done; /* finished (replied or failed), waiting for the requests above before closing */
+    char failed;
+};
+
+struct uloop {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    unsigned sq_local; /* our copy of the sq tail, published on submit */
+    unsigned to_submit;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+
+    struct io_uring_buf_ring* br;
+    unsigned short br_tail;
+    char* bufs;
+
+    struct pcc_shard* shard;
+    struct uconn* pool;
+    int* free_slots; /* stack of unused pool indices */
+    int nfree;
+    int* parked; /* accepted while the pool was full: the multishot accept drains the backlog before its cancel lands */
+    int nparked, parked_head, parked_cap;
+    int accept_armed;
+    int accepted; /* a connection came through the multishot accept, so it is supported */
+    int stopped; /* saw stop_fd */
+    struct pcc_wheel wheel;
+    struct __kernel_timespec tick;
+    int tick_armed;
+};
+
+
+static int uring_setup(unsigned entries, struct io_uring_params* p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* create the ring and map its three regions. returns -1 (errno set) if io_uring can't be used */
+static int ring_init(struct uloop* l) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    /* single issuer (6.0) also guarantees multishot recv; only this thread ever submits */
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = CQ_ENTRIES;
+    l->fd = uring_setup(RING_ENTRIES, &p);
+    if(l->fd < 0)
+        return -1;
+
+    l->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    l->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        if(l->cq_map_len > l->sq_map_len)
+            l->sq_map_len = l->cq_map_len;
+        l->cq_map_len = 0;
+    }
+    l->sq_map = mmap(NULL, l->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, l->fd, IORING_OFF_SQ_RING);
+    if(l->sq_map == MAP_FAILED)
+        return -1;
+    l->cq_map = l->sq_map;
+    if(l->cq_map_len > 0){
+        l->cq_map = mmap(NULL, l->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, l->fd, IORING_OFF_CQ_RING);
+        if(l->cq_map == MAP_FAILED)
+            return -1;
+    }
+    l->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    l->sqes = mmap(NULL, l->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, l->fd, IORING_OFF_SQES);
+    if(l->sqes == MAP_FAILED)
+        return -1;
+
+    l->sq_head = (unsigned*)((char*)l->sq_map + p.sq_off.head);
+    l->sq_tail = (unsigned*)((char*)l->sq_map + p.sq_off.tail);
+    l->sq_mask = (unsigned*)((char*)l->sq_map + p.sq_off.ring_mask);
+    l->sq_array = (unsigned*)((char*)l->sq_map + p.sq_off.array);
+    l->cq_head = (unsigned*)((char*)l->cq_map + p.cq_off.head);
+    l->cq_tail = (unsigned*)((char*)l->cq_map + p.cq_off.tail);
+    l->cq_mask = (unsigned*)((char*)l->cq_map + p.cq_off.ring_mask);
+    l->cqes = (struct io_uring_cqe*)((char*)l->cq_map + p.cq_off.cqes);
+    l->sq_local = *l->sq_tail;
+    return 0;
+}
+
+/* hand the provided buffer bid back to the kernel (visible after buf_publish) */
+static void buf_recycle(struct uloop* l, unsigned bid) {
+    struct io_uring_buf* b = &l->br->bufs[l->br_tail & (NBUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(l->bufs + (size_t)bid * BUF_SIZE);
+    b->len = BUF_SIZE;
+    b->bid = bid;
+    l->br_tail++;
+}
+
+static void buf_publish(struct uloop* l) {
+    __atomic_store_n(&l->br->tail, l->br_tail, __ATOMIC_RELEASE);
+}
+
+/* register the provided buffer ring, group BGID. returns -1 (errno set) if the kernel can't (before 5.19) */
+static int bufs_init(struct uloop* l) {
+    struct io_uring_buf_reg reg;
+
+    l->br = mmap(NULL, NBUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(l->br == MAP_FAILED){
+        l->br = NULL;
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)l->br;
+    reg.ring_entries = NBUFS;
+    reg.bgid = BGID;
+    if(uring_register(l->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+    l->bufs = malloc((size_t)NBUFS * BUF_SIZE);
+    if(l->bufs == NULL){
+        perror("Error: failed setting up io_uring loop: ");
+        exit(1);
+    }
+    for(unsigned i = 0; i < NBUFS; i++)
+        buf_recycle(l, i);
+    buf_publish(l);
+    return 0;
+}
+
+static void ring_exit(struct uloop* l) {
+    if(l->fd >= 0)
+        close(l->fd);
+    if(l->sqes != NULL && l->sqes != MAP_FAILED)
+        munmap(l->sqes, l->sqes_len);
+    if(l->cq_map != NULL && l->cq_map != MAP_FAILED && l->cq_map != l->sq_map)
+        munmap(l->cq_map, l->cq_map_len);
+    if(l->sq_map != NULL && l->sq_map != MAP_FAILED)
+        munmap(l->sq_map, l->sq_map_len);
+    if(l->br != NULL)
+        munmap(l->br, NBUFS * sizeof(struct io_uring_buf));
+    free(l->bufs);
+}
+
+/* submit what is queued; with wait, also block until at least one completion is there */
+static void ring_submit(struct uloop* l, int wait) {
+    __atomic_store_n(l->sq_tail, l->sq_local, __ATOMIC_RELEASE);
+    while(1){
+        int n = uring_enter(l->fd, l->to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+        if(n >= 0){
+            l->to_submit -= n;
+            if(l->to_submit == 0 || wait)
+                return;
+            continue;
+        }
+        if(errno == EINTR || errno == EAGAIN || errno == EBUSY){
+            if(wait) /* completions are pending, go drain them */
+                return;
+            continue;
+        }
+        perror("Error: failed submitting to io_uring: ");
+        exit(1);
+    }
+}
+
+/* next free SQE, zeroed and tagged; flushes the queue to the kernel when the ring is full */
+static struct io_uring_sqe* get_sqe(struct uloop* l, uint64_t user_data) {
+    struct io_uring_sqe* sqe;
+    unsigned idx;
+
+    while(l->sq_local - __atomic_load_n(l->sq_head, __ATOMIC_ACQUIRE) >= RING_ENTRIES)
+        ring_submit(l, 0);
+    idx = l->sq_local & *l->sq_mask;
+    sqe = &l->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    l->sq_array[idx] = idx;
+    l->sq_local++;
+    l->to_submit++;
+    return sqe;
+}
+
+static void arm_accept(struct uloop* l) {
+    struct io_uring_sqe* sqe = get_sqe(l, UD(OP_ACCEPT, 0));
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    l->accept_armed = 1;
+}
+
+static void arm_recv(struct uloop* l, struct uconn* u) {
+    struct io_uring_sqe* sqe = get_sqe(l, UD(OP_RECV, u - l->pool));
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = u->c.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BGID;
+    u->recv_armed = 1;
+}
+
+static void arm_send(struct uloop* l, struct uconn* u) {
+    struct io_uring_sqe* sqe = get_sqe(l, UD(OP_SEND, u - l->pool));
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = u->c.fd;
+    sqe->addr = (uint64_t)(uintptr_t)(u->c.out + u->c.out_off);
+    sqe->len = u->c.out_len - u->c.out_off;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    u->sending = 1;
+}
+
+static void cancel(struct uloop* l, uint64_t target) {
+    struct io_uring_sqe* sqe = get_sqe(l, UD(OP_CANCEL, 0));
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = target;
+}
+
+/* take a pool slot for a freshly accepted fd and start reading its request */
+static void conn_start(struct uloop* l, int fd) {
+    struct uconn* u = &l->pool[l->free_slots[--l->nfree]];
+    memset(u, 0, sizeof(*u));
+    pcc_conn_reset(&u->c, fd);
+    pcc_conn_deadline(&l->wheel, &u->c); /* for its header */
+    arm_recv(l, u);
+}
+
+/* once a finished connection has nothing in flight: close it (its answered requests are committed), free the slot */
+static void conn_release(struct uloop* l, struct uconn* u) {
+    if(!u->done || u->recv_armed || u->sending || u->c.fd < 0) /* busy, or released already */
+        return;
+    close(u->c.fd);
+    pcc_conn_free(&u->c);
+    u->c.fd = -1;
+    l->free_slots[l->nfree++] = u - l->pool;
+    if(l->parked_head < l->nparked){ /* oldest parked client first */
+        conn_start(l, l->parked[l->parked_head++]);
+        if(l->parked_head == l->nparked)
+            l->parked_head = l->nparked = 0;
+    }
+    else if(!l->accept_armed && !stopping){
+        arm_accept(l);
+    }
+}
+
+static void conn_finish(struct uloop* l, struct uconn* u, int failed) {
+    if(u->done)
+        return;
+    u->done = 1;
+    u->failed = failed;
+    pcc_timer_cancel(&l->wheel, &u->c.timer);
+    if(u->recv_armed)
+        cancel(l, UD(OP_RECV, u - l->pool));
+    if(u->sending) /* a client that doesn't take its reply keeps it in flight forever */
+        cancel(l, UD(OP_SEND, u - l->pool));
+    conn_release(l, u);
+}
+
+static void on_accept(struct uloop* l, struct io_uring_cqe* cqe) {
+    if(!(cqe->flags & IORING_CQE_F_MORE))
+        l->accept_armed = 0;
+    if(cqe->res >= 0){
+        l->accepted = 1;
+        if(l->nfree == 0){ /* completed before the cancel below: keep it until a slot frees up */
+            if(l->nparked == l->parked_cap){
+                l->parked_cap = l->parked_cap ? 2 * l->parked_cap : 64;
+                l->parked = realloc(l->parked, sizeof(int) * l->parked_cap);
+                if(l->parked == NULL){
+                    perror("Error: failed parking connection: ");
+                    exit(1);
+                }
+            }
+            l->parked[l->nparked++] = cqe->res;
+            return;
+        }
+        conn_start(l, cqe->res);
+        if(l->nfree == 0 && l->accept_armed) /* pool exhausted, leave the rest in the backlog */
+            cancel(l, UD(OP_ACCEPT, 0));
+    }
+    else if(cqe->res != -ECANCELED && cqe->res != -EINTR && cqe->res != -ECONNABORTED){
+        errno = -cqe->res;
+        perror("Error: failed accepting connection: ");
+        exit(1);
+    }
+    if(!l->accept_armed && !stopping && l->nfree > 0 && l->nparked == 0)
+        arm_accept(l);
+}
+
+static void on_recv(struct uloop* l, struct uconn* u, struct io_uring_cqe* cqe) {
+    int done;
+    if(!(cqe->flags & IORING_CQE_F_MORE))
+        u->recv_armed = 0;
+    if(cqe->res > 0){
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if(!u->done && !u->c.eof){
+            int was_reply = u->c.state == PCC_REPLY;
+            /* v1 ignores anything past the request, v2 keeps it */
+            pcc_conn_feed(&u->c, l->bufs + (size_t)bid * BUF_SIZE, cqe->res);
+            if(u->c.failed)
+                conn_finish(l, u, 1);
+            else if(u->c.v2 && !was_reply && u->c.state == PCC_REPLY && u->recv_armed) /* out[] full: stop reading */
+                cancel(l, UD(OP_RECV, u - l->pool));
+            if(!u->c.failed && u->c.out_off < u->c.out_len && !u->sending)
+                arm_send(l, u);
+            if(!u->done)
+                pcc_conn_deadline(&l->wheel, &u->c);
+        }
+        buf_recycle(l, bid);
+    }
+    else if(cqe->res == 0){
+        if(!u->done && !u->c.eof){ /* client closed its side: fine only between two v2 requests */
+            done = pcc_conn_eof(&u->c);
+            u->c.eof = 1;
+            if(done != 0)
+                conn_finish(l, u, done < 0);
+        }
+    }
+    else if(cqe->res != -ENOBUFS && cqe->res != -ECANCELED && cqe->res != -EINTR){
+        errno = -cqe->res;
+        int err = errno; /* perror() may change errno */
+        perror("Error: failed reading from client: ");
+        if(!is_client_error(err))
+            exit(1);
+        conn_finish(l, u, 1);
+    }
+    /* out of buffers or the kernel ended the multishot: keep reading while the connection takes input */
+    if(!u->recv_armed && !u->done && !u->c.eof && u->c.state != PCC_REPLY)
+        arm_recv(l, u);
+    conn_release(l, u);
+}
+
+static void on_send(struct uloop* l, struct uconn* u, struct io_uring_cqe* cqe) {
+    int done;
+    u->sending = 0;
+    if(u->done){ /* finished while the send was in flight (cancelled) */
+        conn_release(l, u);
+        return;
+    }
+    if(cqe->res < 0){
+        errno = -cqe->res;
+        int err = errno; /* perror() may change errno */
+        perror("Error: failed writing to client: ");
+        if(!is_client_error(err))
+            exit(1);
+        conn_finish(l, u, 1);
+        return;
+    }
+    u->c.out_off += cqe->res;
+    if(u->c.out_off < u->c.out_len){ /* the reply deadline keeps running */
+        arm_send(l, u);
+        return;
+    }
+    /* the replies went out: commit them, then take input again */
+    pcc_commit(l->shard, &u->c);
+    done = pcc_conn_sent(&u->c);
+    if(done != 0){
+        conn_finish(l, u, done < 0);
+        return;
+    }
+    if(u->c.out_off < u->c.out_len) /* the stash gave more replies */
+        arm_send(l, u);
+    if(!u->recv_armed && !u->c.eof && u->c.state != PCC_REPLY)
+        arm_recv(l, u);
+    pcc_conn_deadline(&l->wheel, &u->c);
+}
+
+/* a connection missed its deadline: drop it, unanswered requests and all */
+static void conn_expired(struct pcc_timer* t, void* arg) {
+    struct uloop* l = arg;
+    struct uconn* u = (struct uconn*)((char*)t - offsetof(struct uconn, c.timer));
+    fprintf(stderr, "Error: client timed out\n");
+    conn_finish(l, u, 1);
+}
+
+/* wake the loop after a tick while deadlines are armed */
+static void arm_tick(struct uloop* l) {
+    struct io_uring_sqe* sqe = get_sqe(l, UD(OP_TICK, 0));
+    l->tick.tv_sec = 0;
+    l->tick.tv_nsec = PCC_TICK_MS * 1000000L;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&l->tick;
+    sqe->len = 1;
+    l->tick_armed = 1;
+}
+
+/* thread body for -u: one io_uring loop counting into its own shard, until SIGINT and all its clients are done */
+void* uring_loop(void* shard) {
+    struct uloop l;
+    struct io_uring_sqe* sqe;
+
+    memset(&l, 0, sizeof(l));
+    l.fd = -1;
+    l.shard = shard;
+    if(ring_init(&l) < 0 || bufs_init(&l) < 0){
+        fprintf(stderr, "io_uring unavailable (%s), using epoll\n", strerror(errno));
+        ring_exit(&l);
+        return event_loop(shard);
+    }
+    l.pool = calloc(max_conns, sizeof(struct uconn));
+    l.free_slots = malloc(sizeof(int) * max_conns);
+    if(l.pool == NULL || l.free_slots == NULL){
+        perror("Error: failed setting up io_uring loop: ");
+        exit(1);
+    }
+    for(int i = 0; i < max_conns; i++)
+        l.free_slots[l.nfree++] = max_conns - 1 - i;
+
+    sqe = get_sqe(&l, UD(OP_STOP, 0)); /* one-shot poll: the eventfd stays readable for the other loops */
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = stop_fd;
+    sqe->poll32_events = POLLIN;
+    arm_accept(&l);
+    pcc_wheel_init(&l.wheel);
+
+    while(!l.stopped || l.nfree < max_conns || l.nparked > 0){ /* after SIGINT, finish the connections in flight */
+        unsigned head, tail;
+        if(l.wheel.armed > 0 && !l.tick_armed)
+            arm_tick(&l);
+        buf_publish(&l);
+        ring_submit(&l, 1);
+        head = *l.cq_head;
+        tail = __atomic_load_n(l.cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++){
+            struct io_uring_cqe* cqe = &l.cqes[head & *l.cq_mask];
+            unsigned op = cqe->user_data & 0xff;
+            struct uconn* u = &l.pool[cqe->user_data >> 8];
+            if(op == OP_ACCEPT){
+                if(cqe->res == -EINVAL && !l.accepted){ /* no multishot accept (before 5.19) */
+                    fprintf(stderr, "io_uring multishot accept unavailable, using epoll\n");
+                    ring_exit(&l);
+                    free(l.pool);
+                    free(l.free_slots);
+                    return event_loop(shard);
+                }
+                on_accept(&l, cqe);
+            }
+            else if(op == OP_STOP){
+                l.stopped = 1;
+                if(l.accept_armed)
+                    cancel(&l, UD(OP_ACCEPT, 0));
+            }
+            else if(op == OP_RECV){
+                on_recv(&l, u, cqe);
+            }
+            else if(op == OP_SEND){
+                on_send(&l, u, cqe);
+            }
+            else if(op == OP_TICK){
+                l.tick_armed = 0;
+            }
+        }
+        __atomic_store_n(l.cq_head, head, __ATOMIC_RELEASE);
+        pcc_wheel_advance(&l.wheel, pcc_ticks(), conn_expired, &l);
+    }
+    ring_exit(&l);
+    free(l.pool);
+    free(l.free_slots);
+    free(l.parked);
+    return NULL;
+}
@@ -7,6 +7,8 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <endian.h>
+#include "pcc.h"
 
 /*
 The server accepts TCP connections from clients. A client that connects
@@ -16,11 +18,24 @@ byte b whose value is 32 ≤ b ≤ 126). Once the stream ends, the server sends
 the client over the same connection. In addition, the server maintains a data structure in which it
 counts the number of times each printable character was observed in all the connections. When
 the server receives a SIGINT, it prints these counts and exits.
+
+Protocol: N as a 32-bit unsigned integer in network byte order, then the N bytes; the count comes back
+as a 32-bit unsigned integer. N == CHUNKED (0xFFFFFFFF) streams a body of unknown length instead: chunks,
+each a 64-bit length in network byte order and that many bytes, up to a zero-length chunk; the count
+comes back as a 64-bit unsigned integer. That is what a client reading from a pipe sends, or one with
+more than 4 GB.
+
+Usage: server <port> [-f stats_file [-n fsync_every]]
+With -f the counts start from the stats file and every connection's counts are added to it as well,
+so they survive a restart (see pcc_statsfile.c).
+Build: gcc -O3 -Wall -std=gnu11 -pthread -o server server.c pcc_count.c pcc_statsfile.c
 */
 
+#define CHUNKED 0xFFFFFFFFu // N announcing a chunked body
+
 // Global data structure to count the number of times each printable character was observed
-// in all client connections. The counts are 32-bits unsigned integers.
-uint32_t pcc_total[95];
+// in all client connections. The counts are 64-bits unsigned integers.
+uint64_t pcc_total[95];
 
 // Flag to indicate if the server received a SIGINT signal
 volatile sig_atomic_t sigint_received = 0;
@@ -30,30 +45,89 @@ void sigint_handler(int sig) {
     sigint_received = 1;
 }
 
+// Read exactly len bytes from the client.
+// Returns 0, or -1 on a TCP error or a client that closed the connection early (other errors are fatal).
+int read_exact(int client_sock, void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t bytes_read = read(client_sock, buf, len);
+        if (bytes_read < 0) {
+            if (errno == EINTR) // SIGINT: finish this client first
+                continue;
+            perror("Error receiving from client");
+            if (errno == ETIMEDOUT || errno == ECONNRESET || errno == EPIPE)
+                return -1;
+            exit(1);
+        }
+        if (bytes_read == 0) {
+            fprintf(stderr, "Error: client closed the connection early\n");
+            return -1;
+        }
+        buf = (char *) buf + bytes_read;
+        len -= bytes_read;
+    }
+    return 0;
+}
+
+// Read the next n bytes of the stream through buffer and count them into client_count and *printable_count.
+// Returns 0 or -1 like read_exact().
+int count_bytes(int client_sock, char *buffer, size_t size, uint64_t n, uint64_t *client_count, uint64_t *printable_count) {
+    while (n > 0) {
+        size_t want = n < size ? n : size; // never read past the body
+        if (read_exact(client_sock, buffer, want) < 0)
+            return -1;
+        // Compute count of printable characters and updates the client_count data structure (see pcc_count.c).
+        *printable_count += pcc_count((const unsigned char *) buffer, want, client_count);
+        n -= want;
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     int sock;
     int client_err_flag = 0;  // Flag to indicate a TCP errors or unexpected connection terminate from the client
     int client_sock;
-    int bytes_read;
-    uint32_t pcc_count[95]; // Local data structure to count the number of times each printable character was observed in a client connection
+    uint64_t client_count[95]; // Local data structure to count the number of times each printable character was observed in a client connection
     char buffer[1048576]; // Allocations of up to 1 MB are OK.
     uint16_t server_port; // Port number can be represented with a 16-bit unsigned integer.
-    uint32_t file_size; // The size of the file can be represented with a 32-bit unsigned integer.
-    uint32_t file_size_n; //  Size of the file as a 32-bit unsigned integer network byte order
-    uint32_t printable_count; // The count of printable characters can be represented with a 32-bit unsigned integer.
+    uint32_t file_size_n; //  Size of the file (or CHUNKED) as a 32-bit unsigned integer network byte order
+    uint64_t chunk_size; // Size of the next chunk of a chunked body, 0 at its end
+    uint64_t chunk_size_n;
+    uint64_t printable_count; // Counted in 64 bits, sent back in 32 bits unless the body was chunked
     uint32_t printable_count_n; // The count of printable characters as a 32-bit unsigned integer network byte order
+    uint64_t printable_count_n64; // The same as a 64-bit unsigned integer network byte order (chunked)
+    int chunked;
     struct sigaction sa;
     struct sockaddr_in server_addr;
+    const char *stats_path = NULL; // -f
+    uint64_t stats_count[95] = {0}; // Counts loaded from the stats file
+    uint64_t stats_requests = 0;
+    int opt;
     
     // Validate command line arguments
-    if (argc != 2) {
+    while ((opt = getopt(argc, argv, "f:n:")) != -1) {
+        if (opt == 'f') {
+            stats_path = optarg;
+        } else if (opt == 'n' && atoi(optarg) >= 0) {
+            statsfile_sync_every = atoi(optarg);
+        } else {
+            fprintf(stderr, "Error: usage: %s <port> [-f stats_file [-n fsync_every]]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1) {
         fprintf(stderr, "Error: Invalid number of command line arguments.\n");
         exit(1);
     }
-    server_port = atoi(argv[1]);
+    server_port = atoi(argv[optind]);
 
-    // Initialize pcc_total data structure
+    // Initialize pcc_total data structure, from the stats file if there is one
     memset(pcc_total, 0, sizeof(pcc_total));
+    if (stats_path != NULL) {
+        pcc_statsfile_open(stats_path, stats_count, &stats_requests);
+        for (int i = 0; i < 95; i++) {
+            pcc_total[i] = stats_count[i];
+        }
+    }
 
     // Register the SIGINT signal handler
     memset(&sa, 0, sizeof(sa));
@@ -94,7 +168,7 @@ int main(int argc, char *argv[]) {
     while (!sigint_received) {
         client_err_flag = 0;
         // Initialize pcc_count data structure
-        memset(pcc_count, 0, sizeof(pcc_total));
+        memset(client_count, 0, sizeof(client_count));
         // Accept a new TCP connection
         client_sock = accept(sock, NULL, NULL);
         if (client_sock < 0) {
@@ -106,39 +180,30 @@ int main(int argc, char *argv[]) {
             exit(1);
         }
        
-        // Read the file size from the client
-        if (read(client_sock, &file_size_n, sizeof(file_size_n)) < 0) {
-            perror("Error receiving file size");
-            if(errno == ETIMEDOUT || errno == ECONNRESET || errno == EPIPE || errno == EOF)
-                client_err_flag = 1;
-            else
-                exit(1);
-        }
-        file_size = ntohl(file_size_n); // Convert from network byte order to host byte order
-
-        // Read and process the file content's stream of bytes from the client
+        // Read the file size from the client, then process the file content's stream of bytes
         printable_count = 0;
-        while (file_size > 0) {
-            bytes_read = read(client_sock, buffer, sizeof(buffer));
-            if (bytes_read < 0) {
-                perror("Error receiving file contents");
-                if(errno == ETIMEDOUT || errno == ECONNRESET || errno == EPIPE || errno == EOF)
+        chunked = 0;
+        if (read_exact(client_sock, &file_size_n, sizeof(file_size_n)) < 0) {
+            client_err_flag = 1;
+        } else if (ntohl(file_size_n) != CHUNKED) { // Convert from network byte order to host byte order
+            client_err_flag = count_bytes(client_sock, buffer, sizeof(buffer), ntohl(file_size_n), client_count, &printable_count) < 0;
+        } else {
+            chunked = 1;
+            do {
+                if (read_exact(client_sock, &chunk_size_n, sizeof(chunk_size_n)) < 0) {
                     client_err_flag = 1;
-                else
-                    exit(1);
-            }
-            // Compute count of printable characters and updates the pcc_count data structure.
-            for (int i = 0; i < bytes_read; i++) {
-                if (buffer[i] >= 32 && buffer[i] <= 126) {
-                    pcc_count[buffer[i] - 32]++;
-                    printable_count++;
+                    break;
                 }
-            }
-            file_size -= bytes_read;
+                chunk_size = be64toh(chunk_size_n);
+                client_err_flag = count_bytes(client_sock, buffer, sizeof(buffer), chunk_size, client_count, &printable_count) < 0;
+            } while (chunk_size > 0 && !client_err_flag);
         }
+
         // Send the result of printable count to the client over the TCP connection.
-        printable_count_n = htonl(printable_count); // Convert from host byte order to network byte order.
-        if (write(client_sock, &printable_count_n, sizeof(printable_count_n)) < 0) {
+        printable_count_n = htonl((uint32_t) printable_count); // Convert from host byte order to network byte order.
+        printable_count_n64 = htobe64(printable_count);
+        if (!client_err_flag && write(client_sock, chunked ? (void *) &printable_count_n64 : (void *) &printable_count_n,
+                                      chunked ? sizeof(printable_count_n64) : sizeof(printable_count_n)) < 0) {
             perror("Error sending printable count");
             if(errno == ETIMEDOUT || errno == ECONNRESET || errno == EPIPE || errno == EOF)
                 client_err_flag = 1;
@@ -151,7 +216,10 @@ int main(int argc, char *argv[]) {
         // the server should not update the pcc_total data structure.
         // (not handling overflow of the pcc_total counters).
         for (int i = 0; i < 95 && !client_err_flag; i++) {
-            pcc_total[i] += pcc_count[i];
+            pcc_total[i] += client_count[i];
+        }
+        if (!client_err_flag) {
+            pcc_statsfile_add(client_count, 1); // No-op without a stats file
         }
 
         // Close the client connection
@@ -162,10 +230,11 @@ int main(int argc, char *argv[]) {
     
     // Print the statistics of printable characters observed
     for (int i = 0; i < 95; i++) {
-        printf("char '%c' : %u times\n", i + 32, pcc_total[i]);
+        printf("char '%c' : %lu times\n", i + 32, pcc_total[i]);
     }
 
-    // Close the server socket and exit
+    // Close the server socket and the stats file and exit
     close(sock);
+    pcc_statsfile_close();
     exit(0);
 }